@@ -0,0 +1,478 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <malloc.h>
+#include "p3Heap.h"
+
+/*
+ * Throughput and latency benchmark for p3Heap.
+ *
+ * Every workload is generated up front as a list of operations on a fixed
+ * number of slots (alloc a size into a slot, or free a slot), then replayed
+ * against each allocator with the exact same operations, so p3Heap and the
+ * glibc malloc baseline are measured by the same harness.
+ *
+ * Each run happens in a child process of its own, so the memory footprint
+ * of one run does not leak into the next. For every run it reports:
+ *   - ops/s      operations per second, timer calls included
+ *   - p50/p99/p999 latency of a single alloc or free in ns
+ *   - peak live  most bytes requested and not yet freed at one time
+ *   - peak rss   most resident memory the run added to the process
+ *   - frag       1 - peak live / peak rss, memory lost to overhead and
+ *                fragmentation (pages that are never touched don't count)
+ *
+ * Usage: p3Bench [-n ops] [-s slots] [-a p3heap|glibc] [-w workload] [-t trace]
+ *
+ * Workloads: constant, uniform, powerlaw, prodcons, and trace when a trace
+ * file is given. A trace has one operation per line:
+ *   a <slot> <size>    allocate 'size' bytes into slot 'slot'
+ *   f <slot>           free the block in slot 'slot'
+ */
+
+#define RSS_SAMPLE 4096     // ops between resident size samples
+#define PC_RING 1024        // blocks in flight between producer and consumer
+
+typedef struct benchOp {
+    uint32_t slot;
+    uint32_t size;          // 0 => free
+} benchOp;
+
+typedef struct allocator {
+    const char *name;
+    void* (*alloc)(size_t size);
+    void  (*free)(void *ptr);
+} allocator;
+
+typedef struct runResult {
+    size_t ops;
+    double seconds;
+    uint32_t *lat;          // ns per op
+    size_t peak_live;
+    size_t peak_rss;
+} runResult;
+
+static size_t num_ops = 1000000;
+static size_t num_slots = 8192;
+
+/*
+ * glibc and p3Heap behind the same interface.
+ */
+static void* p3_alloc(size_t size) { return alloc(size); }
+static void  p3_free(void *ptr) { free_block(ptr); }
+
+static allocator allocators[] = {
+    { "p3heap", p3_alloc, p3_free },
+    { "glibc",  malloc,   free },
+};
+#define NUM_ALLOCATORS (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/*
+ * xorshift64*, so every workload is the same on every run.
+ */
+static uint64_t rng(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static uint32_t size_constant(void) { return 64; }
+
+static uint32_t size_uniform(void) { return 1 + rng() % 4096; }
+
+/*
+ * Sizes where P(size > s) falls off as 1/s, from 16 bytes to 64 KiB:
+ * each doubling of the size is half as likely as the previous one.
+ */
+static uint32_t size_powerlaw(void) {
+	int k = 0;
+	while(k < 11 && (rng() & 1)) { k++; }
+
+	uint32_t lo = 16u << k;
+	return lo + rng() % lo;
+}
+
+/*
+ * Generates 'n' operations over 'slots' slots: a random slot is freed if
+ * it holds a block, otherwise a block of size 'next_size()' goes into it.
+ */
+static benchOp* gen_ops(size_t n, size_t slots, uint32_t (*next_size)(void)) {
+	benchOp *ops = malloc(n * sizeof(benchOp));
+	char *used = calloc(slots, 1);
+	if(ops == NULL || used == NULL) { perror("malloc"); exit(1); }
+
+	for(size_t i = 0; i < n; i++) {
+		uint32_t slot = rng() % slots;
+		ops[i].slot = slot;
+		ops[i].size = used[slot] ? 0 : next_size();
+		used[slot] = !used[slot];
+	}
+
+	free(used);
+	return ops;
+}
+
+/*
+ * Reads trace file 'path'.
+ * Sets 'n' to the number of operations and 'slots' to the highest slot + 1.
+ */
+static benchOp* read_trace(const char *path, size_t *n, size_t *slots) {
+	FILE *f = fopen(path, "r");
+	if(f == NULL) { perror(path); exit(1); }
+
+	size_t cap = 1024, count = 0, max_slot = 0;
+	benchOp *ops = malloc(cap * sizeof(benchOp));
+
+	char kind;
+	unsigned long slot, size;
+	char line[128];
+	while(fgets(line, sizeof(line), f) != NULL) {
+		if(sscanf(line, " %c %lu %lu", &kind, &slot, &size) < 2) { continue; }
+		if(kind != 'a' && kind != 'f') { continue; }
+
+		if(count == cap) {
+			cap *= 2;
+			ops = realloc(ops, cap * sizeof(benchOp));
+		}
+		if(ops == NULL) { perror("malloc"); exit(1); }
+
+		ops[count].slot = slot;
+		ops[count].size = (kind == 'a') ? (size > 0 ? size : 1) : 0;
+		if(slot > max_slot) { max_slot = slot; }
+		count++;
+	}
+	fclose(f);
+
+	*n = count;
+	*slots = max_slot + 1;
+	return ops;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Returns the resident size of anonymous memory, file backed pages such as
+ * code are not counted.
+ */
+static size_t rss_bytes(void) {
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f == NULL) { return 0; }
+
+	unsigned long pages = 0, resident = 0, shared = 0;
+	if(fscanf(f, "%lu %lu %lu", &pages, &resident, &shared) != 3) { resident = shared = 0; }
+	fclose(f);
+
+	return (resident - shared) * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Writes every page of 'len' bytes at 'p', so they are resident.
+ * (A plain memset() to zero may be turned into calloc() by the compiler.)
+ */
+static void touch(void *p, size_t len) {
+	volatile char *c = p;
+	for(size_t i = 0; i < len; i += 4096) { c[i] = c[i]; }
+	if(len > 0) { c[len - 1] = c[len - 1]; }
+}
+
+/*
+ * Replays 'n' operations on 'slots' slots with allocator 'a'.
+ * Every block is filled after it is allocated (outside the timed part),
+ * so its pages count towards the resident size.
+ */
+static void run_ops(allocator *a, benchOp *ops, size_t n, size_t slots, runResult *r) {
+	void **ptrs = calloc(slots, sizeof(void*));
+	uint32_t *sizes = calloc(slots, sizeof(uint32_t));
+	r->lat = malloc(n * sizeof(uint32_t));
+	if(ptrs == NULL || sizes == NULL || r->lat == NULL) { perror("malloc"); exit(1); }
+
+	// Bench's own arrays are made resident before the baseline is taken
+	touch(ptrs, slots * sizeof(void*));
+	touch(sizes, slots * sizeof(uint32_t));
+	touch(r->lat, n * sizeof(uint32_t));
+
+	size_t base_rss = rss_bytes();
+	size_t live = 0;
+	r->ops = 0;
+
+	uint64_t start = now_ns();
+	for(size_t i = 0; i < n; i++) {
+		benchOp *op = &ops[i];
+		uint64_t t0, t1;
+
+		if(op->size == 0) {
+			// Traces may free a slot that was never filled
+			if(ptrs[op->slot] == NULL) { continue; }
+
+			t0 = now_ns();
+			a->free(ptrs[op->slot]);
+			t1 = now_ns();
+
+			live -= sizes[op->slot];
+			ptrs[op->slot] = NULL;
+		}
+		else {
+			// Traces may reuse a slot without freeing it first
+			if(ptrs[op->slot] != NULL) {
+				a->free(ptrs[op->slot]);
+				live -= sizes[op->slot];
+			}
+
+			t0 = now_ns();
+			void *p = a->alloc(op->size);
+			t1 = now_ns();
+
+			if(p == NULL) {
+				fprintf(stderr, "%s: alloc(%u) failed\n", a->name, op->size);
+				exit(1);
+			}
+			memset(p, (int)i, op->size);
+
+			ptrs[op->slot] = p;
+			sizes[op->slot] = op->size;
+			live += op->size;
+			if(live > r->peak_live) { r->peak_live = live; }
+		}
+
+		r->lat[r->ops++] = t1 - t0;
+
+		if(i % RSS_SAMPLE == 0) {
+			size_t rss = rss_bytes() - base_rss;
+			if(rss > r->peak_rss) { r->peak_rss = rss; }
+		}
+	}
+	r->seconds = (now_ns() - start) / 1e9;
+
+	size_t rss = rss_bytes() - base_rss;
+	if(rss > r->peak_rss) { r->peak_rss = rss; }
+
+	for(size_t s = 0; s < slots; s++) {
+		if(ptrs[s] != NULL) { a->free(ptrs[s]); }
+	}
+	free(ptrs);
+	free(sizes);
+}
+
+typedef struct pcShared {
+    allocator *a;
+    void *ring[PC_RING];
+    uint32_t ring_size[PC_RING];
+    size_t head;            // written by the producer only
+    size_t tail;            // written by the consumer only
+    size_t count;           // blocks the producer makes
+    size_t live;
+    uint32_t *lat;          // producer's latencies, then the consumer's
+} pcShared;
+
+/*
+ * Consumer thread, frees every block the producer hands over.
+ */
+static void* pc_consumer(void *arg) {
+	pcShared *pc = arg;
+	uint32_t *lat = pc->lat + pc->count;
+
+	for(size_t i = 0; i < pc->count; i++) {
+		while(__atomic_load_n(&pc->head, __ATOMIC_ACQUIRE) == i) { sched_yield(); }
+
+		void *p = pc->ring[i % PC_RING];
+		uint32_t size = pc->ring_size[i % PC_RING];
+
+		uint64_t t0 = now_ns();
+		pc->a->free(p);
+		lat[i] = now_ns() - t0;
+
+		__atomic_sub_fetch(&pc->live, size, __ATOMIC_RELAXED);
+		__atomic_store_n(&pc->tail, i + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*
+ * Producer/consumer: this thread allocates, another one frees, so every
+ * block is freed by a thread other than the one that allocated it.
+ * Up to PC_RING blocks are in flight.
+ */
+static void run_prodcons(allocator *a, size_t n, runResult *r) {
+	pcShared *pc = calloc(1, sizeof(pcShared));
+	pc->a = a;
+	pc->count = n / 2;
+	pc->lat = malloc(pc->count * 2 * sizeof(uint32_t));
+	if(pc->lat == NULL) { perror("malloc"); exit(1); }
+
+	// Sizes made up front, as for the other workloads
+	uint32_t *sizes = malloc(pc->count * sizeof(uint32_t));
+	for(size_t i = 0; i < pc->count; i++) { sizes[i] = 16 + rng() % 497; }
+	touch(pc->lat, pc->count * 2 * sizeof(uint32_t));
+
+	size_t base_rss = rss_bytes();
+
+	pthread_t consumer;
+	uint64_t start = now_ns();
+	pthread_create(&consumer, NULL, pc_consumer, pc);
+
+	for(size_t i = 0; i < pc->count; i++) {
+		while(i - __atomic_load_n(&pc->tail, __ATOMIC_ACQUIRE) >= PC_RING) { sched_yield(); }
+
+		uint64_t t0 = now_ns();
+		void *p = a->alloc(sizes[i]);
+		pc->lat[i] = now_ns() - t0;
+
+		if(p == NULL) {
+			fprintf(stderr, "%s: alloc(%u) failed\n", a->name, sizes[i]);
+			exit(1);
+		}
+		memset(p, (int)i, sizes[i]);
+
+		size_t live = __atomic_add_fetch(&pc->live, sizes[i], __ATOMIC_RELAXED);
+		if(live > r->peak_live) { r->peak_live = live; }
+
+		pc->ring[i % PC_RING] = p;
+		pc->ring_size[i % PC_RING] = sizes[i];
+		__atomic_store_n(&pc->head, i + 1, __ATOMIC_RELEASE);
+
+		if(i % RSS_SAMPLE == 0) {
+			size_t rss = rss_bytes() - base_rss;
+			if(rss > r->peak_rss) { r->peak_rss = rss; }
+		}
+	}
+
+	pthread_join(consumer, NULL);
+	r->seconds = (now_ns() - start) / 1e9;
+	r->ops = pc->count * 2;
+	r->lat = pc->lat;
+
+	free(sizes);
+	free(pc);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void print_header(void) {
+	printf("%-10s %-8s %12s %8s %8s %8s %12s %12s %6s\n",
+			"workload", "alloc", "ops/s", "p50", "p99", "p999",
+			"peak live", "peak rss", "frag");
+}
+
+static void print_result(const char *workload, allocator *a, runResult *r) {
+	if(r->ops == 0) { return; }
+
+	qsort(r->lat, r->ops, sizeof(uint32_t), cmp_u32);
+	double frag = r->peak_rss > r->peak_live ? 1.0 - (double)r->peak_live / r->peak_rss : 0.0;
+
+	printf("%-10s %-8s %12.0f %8u %8u %8u %12zu %12zu %5.1f%%\n",
+			workload, a->name, r->ops / r->seconds,
+			r->lat[r->ops / 2], r->lat[r->ops * 99 / 100], r->lat[r->ops * 999 / 1000],
+			r->peak_live, r->peak_rss, frag * 100);
+}
+
+/*
+ * Runs one workload with allocator 'a' in a child process.
+ * 'ops' is NULL for the producer/consumer workload.
+ */
+static void bench(const char *workload, allocator *a, benchOp *ops, size_t n, size_t slots) {
+	fflush(stdout);
+
+	pid_t pid = fork();
+	if(pid < 0) { perror("fork"); exit(1); }
+
+	if(pid == 0) {
+		// Free memory glibc kept from the parent would hide the baseline's footprint
+		malloc_trim(0);
+
+		if(a->alloc == p3_alloc && init_heap(1024 * 1024) != 0) {
+			fprintf(stderr, "init_heap failed\n");
+			exit(1);
+		}
+
+		runResult r;
+		memset(&r, 0, sizeof(r));
+		if(ops == NULL) { run_prodcons(a, n, &r); }
+		else { run_ops(a, ops, n, slots, &r); }
+
+		print_result(workload, a, &r);
+		fflush(stdout);
+		_exit(0);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("%-10s %-8s failed\n", workload, a->name);
+	}
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-n ops] [-s slots] [-a p3heap|glibc] [-w workload] [-t trace]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *only_alloc = NULL;
+	const char *only_workload = NULL;
+	const char *trace = NULL;
+
+	int opt;
+	while((opt = getopt(argc, argv, "n:s:a:w:t:")) != -1) {
+		switch(opt) {
+			case 'n': num_ops = strtoul(optarg, NULL, 10); break;
+			case 's': num_slots = strtoul(optarg, NULL, 10); break;
+			case 'a': only_alloc = optarg; break;
+			case 'w': only_workload = optarg; break;
+			case 't': trace = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if(num_ops == 0 || num_slots == 0) { usage(argv[0]); }
+
+	struct {
+		const char *name;
+		uint32_t (*next_size)(void);
+	} workloads[] = {
+		{ "constant", size_constant },
+		{ "uniform",  size_uniform },
+		{ "powerlaw", size_powerlaw },
+		{ "prodcons", NULL },
+		{ "trace",    NULL },
+	};
+	int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+
+	print_header();
+	for(int w = 0; w < num_workloads; w++) {
+		const char *name = workloads[w].name;
+		if(only_workload != NULL && strcmp(only_workload, name) != 0) { continue; }
+
+		benchOp *ops = NULL;
+		size_t n = num_ops, slots = num_slots;
+		if(strcmp(name, "trace") == 0) {
+			if(trace == NULL) { continue; }
+			ops = read_trace(trace, &n, &slots);
+		}
+		else if(workloads[w].next_size != NULL) {
+			ops = gen_ops(n, slots, workloads[w].next_size);
+		}
+
+		for(int i = 0; i < NUM_ALLOCATORS; i++) {
+			if(only_alloc != NULL && strcmp(only_alloc, allocators[i].name) != 0) { continue; }
+			bench(name, &allocators[i], ops, n, slots);
+		}
+		free(ops);
+	}
+
+	return 0;
+}
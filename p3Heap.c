@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // mremap()
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -5,9 +6,52 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 #include "p3Heap.h"
 #include <limits.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Block format, chosen at compile time.
+ *
+ * The default compact format uses 4 byte headers and 8 byte alignment.
+ * It keeps the per-block overhead low, but block sizes are ints, so no
+ * single block can be larger than about 2 GiB.
+ *
+ * Building with -DP3_HEAP64 switches to 8 byte headers holding size_t
+ * block sizes, with 16 byte alignment, for heaps and blocks of any size.
+ */
+#ifdef P3_HEAP64
+typedef size_t bsize_t;
+#define HDR_SIZE 8
+#define ALIGNMENT 16
+#define BSIZE_MAX (SIZE_MAX & ~(size_t)(ALIGNMENT - 1))
+#else
+typedef int bsize_t;
+#define HDR_SIZE 4
+#define ALIGNMENT 8
+#define BSIZE_MAX (INT_MAX & ~(ALIGNMENT - 1))
+#endif
+
+_Static_assert(HDR_SIZE == sizeof(bsize_t), "a header is one bsize_t");
+_Static_assert((ALIGNMENT & (ALIGNMENT - 1)) == 0, "rounding to ALIGNMENT is a mask");
+
+// Padding in front of the first block of a segment so payloads are aligned
+#define SEG_PAD (ALIGNMENT - HDR_SIZE)
+
+// Status bits of size_status (see blockHeader), the rest is the block size
+// (blocks in a fast bin also have FAST_BIT set, see there)
+#define A_BIT 0x1           // this block is allocated
+#define P_BIT 0x2           // the previous block is allocated
+#define STATUS_BITS (A_BIT | P_BIT)
 
 /*
  * This structure serves as the header for each allocated and free block.
@@ -16,7 +60,7 @@
 typedef struct blockHeader {           
 
     /*
-     * 1) The size of each heap block must be a multiple of 8
+     * 1) The size of each heap block must be a multiple of ALIGNMENT
      * 2) Heap blocks have blockHeaders that contain size and status bits
      * 3) Free heap blocks contain a footer, but we can use the blockHeader 
      *
@@ -33,11 +77,15 @@ typedef struct blockHeader {
      *   Bit1 == 1 => previous block is allocated
      * 
      * Start Heap: 
-     *  The blockHeader for the first block of heap is after skipping 4 bytes.
+     *  The blockHeader for the first block of heap is after skipping
+     *  SEG_PAD bytes (4 bytes in the compact format).
      *  This ensures alignment requirements can be met.
      * 
      * End Mark: 
-     *  The end of the available memory is indicated using a size_status of 1.
+     *  The end of the available memory is indicated using a block of size 0
+     *  with its a-bit set, i.e. a size_status of 1 (or 3 when the last block
+     *  is allocated, the end mark's p-bit tracks the last block like any
+     *  other header). Every heap segment ends with an end mark.
      * 
      * Examples:
      * 
@@ -53,10 +101,16 @@ typedef struct blockHeader {
      *    Free Block Footer:
      *      size_status should be 24
      */
-    int size_status;
+    bsize_t size_status;
 
 } blockHeader;         
 
+// The header of a block in use is read by ptr_check() of any thread without
+// its heap's lock, while the heap sets or clears its p-bit under the lock
+#define HDR_LOAD(b) __atomic_load_n(&(b)->size_status, __ATOMIC_RELAXED)
+#define HDR_SET_PBIT(b) __atomic_store_n(&(b)->size_status, HDR_LOAD(b) | P_BIT, __ATOMIC_RELAXED)
+#define HDR_CLEAR_PBIT(b) __atomic_store_n(&(b)->size_status, HDR_LOAD(b) & ~P_BIT, __ATOMIC_RELAXED)
+
 /* Global variable - DO NOT CHANGE NAME or TYPE. 
  * It must point to the first block in the heap and is set by init_heap()
  * i.e., the block at the lowest address.
@@ -64,38 +118,849 @@ typedef struct blockHeader {
 blockHeader *heap_start = NULL;     
 
 /* Size of heap allocation padded to round to the nearest page size.
+ * Grows as alloc() maps more segments.
  */
-int alloc_size;
+size_t alloc_size;
 
 /*
  * Additional global variables may be added as needed below
  * TODO: add global variables as needed by your function
  */
-char* heap_end = NULL; // Address of where the heap ends
+char* heap_end = NULL; // Address of where the first heap segment ends
+
+// Allocation requests that ran out of memory, for heap_stats(), atomic
+static size_t failed_allocs = 0;
+
+/*
+ * Heap segments.
+ *
+ * init_heap() maps the first segment, alloc() maps more when no free block
+ * fits. A new mapping that lands right after an existing segment is merged
+ * into it (its old end mark becomes the header of the new space), anything
+ * else becomes a segment of its own with the same layout as the first one:
+ *
+ *   [SEG_PAD bytes][first block ...][end mark]
+ *
+ * heap_start always stays the first block of the first segment.
+ * Segments of all heaps are in one table, each belongs to a single heap and
+ * is only ever merged with segments of the same heap. The entry of a
+ * heap_destroy()ed heap has no owner and is reused by the next one.
+ * Direct mappings keep their entry in front of their block instead, see
+ * direct_alloc().
+ */
+typedef struct heapSegment {
+    char *start;            // start of the mapping
+    size_t len;             // length of the mapping
+    struct heap *owner;     // heap its blocks belong to, NULL if unused
+    int direct;             // holds a single block of direct_alloc()
+    unsigned int seq;       // odd while start and len change, see seg_set()
+} heapSegment;
+
+#define MAX_SEGMENTS 1024
+#define GROW_MIN (256 * 1024)
+
+// Smallest block that realloc_block() grows with mremap() instead of copying
+#define MREMAP_MIN (1024 * 1024)
+
+static heapSegment segments[MAX_SEGMENTS];
+static int num_segments = 0;
+
+/*
+ * Page options init_heap_flags() was given, used for every mapping.
+ * map_page is the page size the heap is mapped (and trimmed) in, the huge
+ * page size when huge pages were asked for, so every segment length is a
+ * multiple of it.
+ */
+static int heap_flags = 0;
+static size_t map_page = 4096;
+
+/*
+ * Hardened mode, built with -DP3_HARDENED.
+ *
+ * free_block() on its own only checks that a pointer is aligned, inside
+ * the heap and that the header in front of it has its a-bit set. A pointer
+ * into the middle of a block, or into a block that was freed and is now
+ * part of a bigger block, can get through that and corrupt headers.
+ * Hardened builds keep a side table with one bit per ALIGNMENT bytes of
+ * heap memory, set for exactly the payloads alloc() and friends handed out
+ * that are not freed yet. free_block() tests and clears the bit atomically
+ * before it reads any header, so every invalid or repeated free is
+ * rejected in O(1), even one racing with another free of the same pointer.
+ *
+ * The table is a radix tree over the address space, like a page table:
+ * each of the STARTS_L1 entries of starts_root covers STARTS_L2 leaves,
+ * and each leaf is the bitmap of STARTS_CHUNK bytes. Nodes are mapped
+ * along with the heap memory they cover and never unmapped, so lookups
+ * take no lock. Without P3_HARDENED all of this compiles away.
+ */
+#ifdef P3_HARDENED
+#define STARTS_CHUNK_BITS 22    // a leaf covers 4 MiB
+#define STARTS_L2_BITS 13
+#define STARTS_L1_BITS (48 - STARTS_CHUNK_BITS - STARTS_L2_BITS)
+#define STARTS_L2 (1ul << STARTS_L2_BITS)
+#define STARTS_LEAF_WORDS ((1ul << STARTS_CHUNK_BITS) / ALIGNMENT / 64)
+
+static unsigned long **starts_root[1ul << STARTS_L1_BITS];
+static pthread_mutex_t starts_lock = PTHREAD_MUTEX_INITIALIZER; // mapping nodes
+
+/*
+ * Returns the word of the side table that holds the bit of 'ptr' and
+ * stores the bit in 'mask', or NULL if no heap memory is mapped there.
+ */
+static unsigned long* starts_word(void *ptr, unsigned long *mask) {
+	uintptr_t addr = (uintptr_t)ptr;
+	if(addr >> 48 != 0) { return NULL; }
+
+	unsigned long **l2 = __atomic_load_n(&starts_root[addr >> (STARTS_CHUNK_BITS + STARTS_L2_BITS)], __ATOMIC_ACQUIRE);
+	if(l2 == NULL) { return NULL; }
+	unsigned long *leaf = __atomic_load_n(&l2[(addr >> STARTS_CHUNK_BITS) & (STARTS_L2 - 1)], __ATOMIC_ACQUIRE);
+	if(leaf == NULL) { return NULL; }
+
+	size_t bit = (addr & ((1ul << STARTS_CHUNK_BITS) - 1)) / ALIGNMENT;
+	*mask = 1ul << (bit % 64);
+	return &leaf[bit / 64];
+}
+
+/*
+ * Maps the side table nodes that cover heap memory 'addr' of 'len' bytes.
+ * Returns 0 on success.
+ * Returns -1 if the O.S. is out of memory.
+ */
+static int starts_map(char *addr, size_t len) {
+	uintptr_t first = (uintptr_t)addr >> STARTS_CHUNK_BITS;
+	uintptr_t last = ((uintptr_t)addr + len - 1) >> STARTS_CHUNK_BITS;
+	int ret = 0;
+
+	pthread_mutex_lock(&starts_lock);
+	for(uintptr_t chunk = first; chunk <= last && ret == 0; chunk++) {
+		unsigned long ***l2 = &starts_root[chunk / STARTS_L2];
+		if(*l2 == NULL) {
+			void *node = mmap(NULL, STARTS_L2 * sizeof(unsigned long*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(MAP_FAILED == node) { ret = -1; break; }
+			__atomic_store_n(l2, node, __ATOMIC_RELEASE);
+		}
+
+		unsigned long **leaf = &(*l2)[chunk % STARTS_L2];
+		if(*leaf == NULL) {
+			void *node = mmap(NULL, STARTS_LEAF_WORDS * sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(MAP_FAILED == node) { ret = -1; break; }
+			__atomic_store_n(leaf, node, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&starts_lock);
+
+	return ret;
+}
+
+/*
+ * Marks 'ptr' as a payload handed out to the user.
+ */
+static void starts_set(void *ptr) {
+	unsigned long mask;
+	unsigned long *word = starts_word(ptr, &mask);
+	if(word != NULL) { __atomic_fetch_or(word, mask, __ATOMIC_RELAXED); }
+}
+
+/*
+ * Unmarks payload 'ptr'.
+ * Returns 1 if it was marked, 0 if it was not handed out (or is freed).
+ */
+static int starts_clear(void *ptr) {
+	unsigned long mask;
+	unsigned long *word = starts_word(ptr, &mask);
+	return word != NULL && (__atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+/*
+ * Returns 1 if 'ptr' is a payload handed out to the user and not freed.
+ */
+static int starts_test(void *ptr) {
+	unsigned long mask;
+	unsigned long *word = starts_word(ptr, &mask);
+	return word != NULL && (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+/*
+ * Unmarks every payload in heap memory 'addr' of 'len' bytes, both page
+ * aligned, before the memory is unmapped.
+ */
+static void starts_unmap(char *addr, size_t len) {
+	unsigned long mask;
+	for(char *p = addr; p < addr + len; p += 64 * ALIGNMENT) {
+		unsigned long *word = starts_word(p, &mask);
+		if(word != NULL) { __atomic_store_n(word, 0, __ATOMIC_RELAXED); }
+	}
+}
+#else
+static inline int starts_map(char *addr, size_t len) { return 0; }
+static inline void starts_set(void *ptr) { }
+static inline int starts_clear(void *ptr) { return 1; }
+static inline int starts_test(void *ptr) { return 1; }
+static inline void starts_unmap(char *addr, size_t len) { }
+#endif
+
+// From <linux/mman.h>, which glibc's <sys/mman.h> does not always pull in
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// End mark of segment 'seg'
+#define SEG_END_MARK(seg) ((blockHeader*)((seg)->start + (seg)->len - HDR_SIZE))
+
+/*
+ * Explicit free lists.
+ *
+ * Every free block is kept on one of NUM_CLASSES doubly linked lists,
+ * segregated by block size. The links are stored in the payload of the
+ * free block, right after its header:
+ *
+ *   [header][next][prev] ... [footer]
+ *
+ * Class i holds free blocks with a size in [2^(i+4), 2^(i+5)), the last
+ * class holds everything bigger. free_map has bit i set when list i is
+ * not empty so alloc() can jump straight to the next class that has a fit.
+ *
+ * Only the classes below TREE_CLASS are lists. Free blocks of TREE_MIN_SIZE
+ * bytes and up, of which there can be many with all kinds of sizes, are
+ * kept in one AVL tree ordered by size (then address) instead, so the best
+ * fit, insert and remove are all O(log n). The tree node is stored in the
+ * payload of the free block in place of the list links:
+ *
+ *   [header][left][right][size][height] ... [footer]
+ *
+ * A block has to be able to hold its links or node once it is freed, so no
+ * block is ever smaller than MIN_BLOCK_SIZE. That way the links or node of
+ * a free block never overwrite the stale header of a block that was
+ * coalesced into it, which free_block() relies on to catch double frees.
+ */
+typedef struct freeLinks {
+    blockHeader *next;
+    blockHeader *prev;
+} freeLinks;
+
+#ifdef P3_HEAP64
+#define NUM_CLASSES 32
+#else
+#define NUM_CLASSES 27
+#endif
+
+typedef struct freeNode {
+    blockHeader *left;      // smaller blocks
+    blockHeader *right;     // larger blocks
+    bsize_t size;           // the key, so the tree never reads headers
+    short height;           // height of the subtree, a leaf is 1
+    short released;         // 1 if its whole pages were given back, see trim_block()
+} freeNode;
+
+#define FREE_META_SIZE \
+    (sizeof(freeNode) > sizeof(freeLinks) ? (int)sizeof(freeNode) : (int)sizeof(freeLinks))
+#define MIN_BLOCK_SIZE \
+    ((HDR_SIZE + FREE_META_SIZE + HDR_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+// Links of a free block live at the start of its payload
+#define LINKS(b) ((freeLinks*)((char*)(b) + HDR_SIZE))
+
+#define TREE_MIN_SIZE 1024
+#define TREE_CLASS 6        // size_class(TREE_MIN_SIZE)
+
+// Tree node of a free block, also at the start of its payload
+#define NODE(b) ((freeNode*)((char*)(b) + HDR_SIZE))
+
+/*
+ * Deferred coalescing (fast bins).
+ *
+ * In a heap made with HEAP_DEFER_COALESCE, free_block() doesn't coalesce
+ * blocks smaller than TREE_MIN_SIZE right away. They go on the fast bin
+ * for their exact size instead, a singly linked list through the payload,
+ * and the next alloc() of that size takes them back without a search or a
+ * split. A block in a fast bin stays marked allocated, so the p-bit of the
+ * next block stays 1 and no neighbour coalesces with it, and has FAST_BIT
+ * set in its header so free_block() still rejects freeing it twice.
+ *
+ * The bins are coalesced (consolidated) like any other free only when an
+ * allocation finds no free block that fits, before the heap is grown, and
+ * by heap_consolidate(). Until then their blocks count as in use.
+ */
+#define FAST_BIT 0x4
+#define FAST_BINS (TREE_MIN_SIZE / ALIGNMENT)
+
+/*
+ * Heaps (arenas).
+ *
+ * The memory is split into independent heaps, each with its own lock, free
+ * lists, tree and segments (so its own block list and end marks). A thread
+ * is bound to one heap at its first alloc(): the heap of the CPU it runs on
+ * (building with -DP3_THREAD_HEAPS gives every thread a heap of its own
+ * instead, round robin over MAX_HEAPS). Heaps are made lazily, the first
+ * one (heaps[0]) is the one init_heap() maps, and each heap's memory is
+ * bound to the NUMA node of the CPU that made it with mbind().
+ *
+ * Every block belongs to the heap of the segment it is in. A thread that
+ * frees a block of another heap doesn't wait for that heap's lock, it
+ * pushes the block on the heap's remote list instead, which the heap's own
+ * threads drain (and coalesce normally) the next time they take the lock.
+ * The remote list is a lock-free stack with many producers and a single
+ * consumer: pushes are a compare-and-swap of the head, and the owner takes
+ * the whole stack at once with an exchange. Since nothing ever pops a
+ * single entry, the stack has no ABA problem.
+ *
+ * heap_create() makes separate heaps that are not in heaps[] and that no
+ * thread is bound to, see there.
+ */
+#define MAX_HEAPS 64
+#define MAX_CPUS 1024
+
+// mbind() policy, from <numaif.h> which is not always installed
+#define MPOL_PREFERRED 1
+
+typedef struct heap {
+    pthread_mutex_t lock;   // protects everything below but remote
+    int id;                 // index in heaps[]
+    int node;               // NUMA node its memory is bound to, -1 for none
+    int last_seg;           // the segment mapped last, -1 if none yet
+    blockHeader *free_lists[NUM_CLASSES];
+    blockHeader *rovers[TREE_CLASS]; // where the next next-fit search of each list starts
+    unsigned int free_map;
+    blockHeader *free_tree;
+    // Number and total size of the free blocks of each class, for heap_stats()
+    size_t fl_count[NUM_CLASSES];
+    size_t fl_bytes[NUM_CLASSES];
+    size_t used_blocks;     // allocated blocks
+    size_t released_bytes;  // pages of free blocks given back to the O.S.
+    blockHeader *fast_bins[FAST_BINS]; // freed blocks not coalesced yet, by size / ALIGNMENT
+    size_t fast_blocks;     // blocks in fast bins
+    void *remote;           // blocks freed by other heaps' threads, linked through their payload
+    struct heapFile *file;  // start of the file of a heap_open() heap, NULL otherwise
+    int fd;                 // that file, kept open for its lock
+} heap;
+
+static heap heaps[MAX_HEAPS] = {
+    [0] = { .lock = PTHREAD_MUTEX_INITIALIZER, .node = -1, .last_seg = -1 },
+};
+static int num_heaps = 1;
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER; // making heaps, appending segments
+
+static int num_nodes = 1;                       // NUMA nodes in the system
+#ifndef P3_THREAD_HEAPS
+static signed char cpu_heaps[MAX_CPUS];         // heap id + 1 of each CPU, 0 if unset
+#endif
+static __thread heap *thread_heap_ptr = NULL;   // heap this thread is bound to
+
+// Heap 'h' is one of heaps[], not one made by heap_create()
+#define IS_SHARED(h) ((h) >= heaps && (h) < heaps + MAX_HEAPS)
+
+/*
+ * Returns the index of the free list that a block of 'size' bytes belongs to.
+ */
+static int size_class(bsize_t size) {
+	// floor(log2(size)) - 4, sizes below 32 all share class 0
+	int cls = (63 - __builtin_clzll((unsigned long long)size | 16)) - 4;
+	return cls < NUM_CLASSES ? cls : NUM_CLASSES - 1;
+}
+
+/*
+ * Compares the key ('size', 'b') with the key of tree node 'node'.
+ */
+static int tree_cmp(bsize_t size, blockHeader *b, blockHeader *node) {
+	if(size != NODE(node)->size) { return size < NODE(node)->size ? -1 : 1; }
+	return (b > node) - (b < node);
+}
+
+static int tree_height(blockHeader *n) {
+	return n != NULL ? NODE(n)->height : 0;
+}
+
+static void tree_update(blockHeader *n) {
+	int l = tree_height(NODE(n)->left);
+	int r = tree_height(NODE(n)->right);
+	NODE(n)->height = (l > r ? l : r) + 1;
+}
+
+static blockHeader* tree_rotate_right(blockHeader *n) {
+	blockHeader *l = NODE(n)->left;
+	NODE(n)->left = NODE(l)->right;
+	NODE(l)->right = n;
+	tree_update(n);
+	tree_update(l);
+	return l;
+}
+
+static blockHeader* tree_rotate_left(blockHeader *n) {
+	blockHeader *r = NODE(n)->right;
+	NODE(n)->right = NODE(r)->left;
+	NODE(r)->left = n;
+	tree_update(n);
+	tree_update(r);
+	return r;
+}
+
+/*
+ * Restores the AVL balance of subtree 'n' after an insert or remove below
+ * it, returns the new root of the subtree.
+ */
+static blockHeader* tree_balance(blockHeader *n) {
+	tree_update(n);
+	int balance = tree_height(NODE(n)->left) - tree_height(NODE(n)->right);
+
+	if(balance > 1) {
+		blockHeader *l = NODE(n)->left;
+		if(tree_height(NODE(l)->left) < tree_height(NODE(l)->right)) {
+			NODE(n)->left = tree_rotate_left(l);
+		}
+		return tree_rotate_right(n);
+	}
+	if(balance < -1) {
+		blockHeader *r = NODE(n)->right;
+		if(tree_height(NODE(r)->right) < tree_height(NODE(r)->left)) {
+			NODE(n)->right = tree_rotate_right(r);
+		}
+		return tree_rotate_left(n);
+	}
+	return n;
+}
+
+/*
+ * Inserts free block 'b' of 'size' bytes in subtree 'root',
+ * returns the new root of the subtree.
+ */
+static blockHeader* tree_insert(blockHeader *root, blockHeader *b, bsize_t size) {
+	if(root == NULL) {
+		NODE(b)->left = NULL;
+		NODE(b)->right = NULL;
+		NODE(b)->size = size;
+		NODE(b)->height = 1;
+		NODE(b)->released = 0;
+		return b;
+	}
+
+	if(tree_cmp(size, b, root) < 0) { NODE(root)->left = tree_insert(NODE(root)->left, b, size); }
+	else { NODE(root)->right = tree_insert(NODE(root)->right, b, size); }
+
+	return tree_balance(root);
+}
+
+/*
+ * Unlinks the smallest node of subtree 'root' and stores it in 'min',
+ * returns the new root of the subtree.
+ */
+static blockHeader* tree_remove_min(blockHeader *root, blockHeader **min) {
+	if(NODE(root)->left == NULL) {
+		*min = root;
+		return NODE(root)->right;
+	}
+	NODE(root)->left = tree_remove_min(NODE(root)->left, min);
+	return tree_balance(root);
+}
+
+/*
+ * Removes free block 'b' of 'size' bytes from subtree 'root',
+ * returns the new root of the subtree.
+ */
+static blockHeader* tree_remove(blockHeader *root, blockHeader *b, bsize_t size) {
+	int cmp = tree_cmp(size, b, root);
+	if(cmp < 0) {
+		NODE(root)->left = tree_remove(NODE(root)->left, b, size);
+		return tree_balance(root);
+	}
+	if(cmp > 0) {
+		NODE(root)->right = tree_remove(NODE(root)->right, b, size);
+		return tree_balance(root);
+	}
+
+	// Found it, its successor (if it has a right subtree) takes its place
+	blockHeader *left = NODE(root)->left;
+	blockHeader *right = NODE(root)->right;
+	if(right == NULL) { return left; }
+
+	blockHeader *succ = NULL;
+	right = tree_remove_min(right, &succ);
+	NODE(succ)->left = left;
+	NODE(succ)->right = right;
+	return tree_balance(succ);
+}
+
+/*
+ * Returns the first free block in the tree of heap 'h' whose key is ('size', 'after')
+ * or more, the smallest block of at least 'size' bytes when 'after' is
+ * NULL. Returns NULL if there is none.
+ */
+static blockHeader* tree_ceil(heap *h, bsize_t size, blockHeader *after) {
+	blockHeader *found = NULL;
+	blockHeader *n = h->free_tree;
+	while(n != NULL) {
+		if(tree_cmp(size, after, n) <= 0) {
+			found = n;
+			n = NODE(n)->left;
+		}
+		else {
+			n = NODE(n)->right;
+		}
+	}
+	return found;
+}
+
+/*
+ * Returns the largest free block in the tree of heap 'h', or NULL if it is empty.
+ */
+static blockHeader* tree_max(heap *h) {
+	blockHeader *n = h->free_tree;
+	while(n != NULL && NODE(n)->right != NULL) { n = NODE(n)->right; }
+	return n;
+}
+
+/*
+ * Trimming.
+ *
+ * The pages of free memory would stay resident forever, so whenever
+ * free_block() leaves a free block of TRIM_THRESHOLD bytes or more, the
+ * whole pages inside it are given back to the O.S. with madvise() (pages
+ * of map_page bytes, so huge pages are never split). Only
+ * the pages between its tree node and its footer go, its header, node and
+ * footer stay where they are. heap_trim() does the same for every tree
+ * block, whatever its size.
+ *
+ * A block whose pages are gone is marked in its node, and the released
+ * bytes are counted per heap until the block leaves the tree (its pages
+ * come back as they are touched). A free block split off a released one
+ * is released too without another madvise(), its pages are a subset of
+ * the old block's, and a block coalesced with a released neighbour only
+ * gives back the pages the neighbour had not already.
+ *
+ * MADV_DONTNEED is used rather than MADV_FREE so that the pages are gone
+ * right away, not only once the system runs short of memory. The pages
+ * of a heap_open() file would come back from the file as they were, so
+ * those are punched out of the file with MADV_REMOVE instead (where the
+ * file system can't do that, they are simply not trimmed).
+ * A heap made with HEAP_POPULATE is only trimmed by heap_trim(), it is
+ * meant to take no page faults once it is set up.
+ */
+#define TRIM_THRESHOLD (128 * 1024)
+
+/*
+ * Returns the length of the whole pages inside free block 'b' of 'size'
+ * bytes, after its tree node and before its footer, and stores the first
+ * of those pages in 'start'.
+ */
+static size_t trim_range(blockHeader *b, bsize_t size, char **start) {
+	uintptr_t pagesize = map_page;
+	uintptr_t lo = ((uintptr_t)NODE(b) + sizeof(freeNode) + pagesize - 1) & ~(pagesize - 1);
+	uintptr_t hi = ((uintptr_t)b + size - HDR_SIZE) & ~(pagesize - 1);
+
+	*start = (char*)lo;
+	return hi > lo ? hi - lo : 0;
+}
+
+/*
+ * Returns 1 if the pages of free block 'b' of 'size' bytes were given back.
+ */
+static int is_released(blockHeader *b, bsize_t size) {
+	return size_class(size) >= TREE_CLASS && NODE(b)->released;
+}
+
+/*
+ * Marks tree block 'b' of 'size' bytes of heap 'h' as released and counts
+ * its pages, for a block whose pages are already gone.
+ */
+static void mark_released(heap *h, blockHeader *b, bsize_t size) {
+	char *start;
+	size_t len = trim_range(b, size, &start);
+	if(size_class(size) < TREE_CLASS || NODE(b)->released || len == 0) { return; }
+
+	NODE(b)->released = 1;
+	h->released_bytes += len;
+}
+
+/*
+ * Gives the whole pages of tree block 'b' of 'size' bytes of heap 'h'
+ * back to the O.S.
+ * Caller must hold h->lock.
+ * Pages in front of 'from' and from 'to' on are known to be released
+ * already (pages of a coalesced neighbour) and are skipped, NULL for none.
+ */
+static void trim_block(heap *h, blockHeader *b, bsize_t size, char *from, char *to) {
+	char *start;
+	size_t len = trim_range(b, size, &start);
+	if(len == 0 || NODE(b)->released) { return; }
+
+	if(from < start) { from = start; }
+	if(to == NULL || to > start + len) { to = start + len; }
+	if(from < to && madvise(from, to - from, h->file != NULL ? MADV_REMOVE : MADV_DONTNEED) != 0) { return; }
+
+	mark_released(h, b, size);
+}
+
+/*
+ * Pushes free block 'b' of 'size' bytes onto the front of its free list
+ * in heap 'h', or into the tree if it is large.
+ */
+static void fl_insert(heap *h, blockHeader *b, bsize_t size) {
+	int cls = size_class(size);
+	h->fl_count[cls]++;
+	h->fl_bytes[cls] += size;
+
+	if(cls >= TREE_CLASS) {
+		h->free_tree = tree_insert(h->free_tree, b, size);
+		return;
+	}
+
+	blockHeader *head = h->free_lists[cls];
+
+	LINKS(b)->prev = NULL;
+	LINKS(b)->next = head;
+	if(head != NULL) { LINKS(head)->prev = b; }
+
+	h->free_lists[cls] = b;
+	h->free_map |= 1u << cls;
+}
+
+/*
+ * Unlinks free block 'b' of 'size' bytes from its free list or the tree
+ * in heap 'h'.
+ */
+static void fl_remove(heap *h, blockHeader *b, bsize_t size) {
+	int cls = size_class(size);
+	h->fl_count[cls]--;
+	h->fl_bytes[cls] -= size;
+
+	if(cls >= TREE_CLASS) {
+		// Its pages come back as the block gets used
+		char *start;
+		if(NODE(b)->released) { h->released_bytes -= trim_range(b, size, &start); }
+		h->free_tree = tree_remove(h->free_tree, b, size);
+		return;
+	}
+
+	blockHeader *next = LINKS(b)->next;
+	blockHeader *prev = LINKS(b)->prev;
+
+	if(prev != NULL) { LINKS(prev)->next = next; }
+	else { h->free_lists[cls] = next; }
+	if(next != NULL) { LINKS(next)->prev = prev; }
+	if(h->rovers[cls] == b) { h->rovers[cls] = next; }
+
+	if(h->free_lists[cls] == NULL) { h->free_map &= ~(1u << cls); }
+}
+
+/*
+ * Placement policies.
+ *
+ * The lists are searched with fl_search, which init_heap_flags() points at
+ * the policy it was asked for, so find_fit() itself never checks which
+ * policy is in use:
+ * - fl_best   BEST-FIT, the default, the smallest block that fits (stops
+ *             early on an exact match)
+ * - fl_first  HEAP_FIRST_FIT, the first block that fits
+ * - fl_next   HEAP_NEXT_FIT, first fit starting where the last search of
+ *             the same list stopped (each list has a roving pointer)
+ * - fl_good   HEAP_GOOD_FIT(pct), best fit that stops at the first block
+ *             at most pct percent larger than the request
+ * First and next fit trade fragmentation for shorter searches.
+ */
+static blockHeader* fl_best(heap *h, int cls, bsize_t size);
+static blockHeader* (*fl_search)(heap *h, int cls, bsize_t size) = fl_best;
+static int good_fit_pct = 0;
+
+/*
+ * Returns the smallest free block in list 'cls' of heap 'h' that is at
+ * least 'size' bytes, or NULL if there is none. Stops early on an exact match.
+ */
+static blockHeader* fl_best(heap *h, int cls, bsize_t size) {
+	blockHeader *bestFit = NULL;
+	bsize_t bestSize = BSIZE_MAX;
+
+	for(blockHeader *current = h->free_lists[cls]; current != NULL; current = LINKS(current)->next) {
+		bsize_t blockSize = current->size_status & ~STATUS_BITS;
+		if(blockSize >= size && (bestFit == NULL || blockSize < bestSize)) {
+			bestSize = blockSize;
+			bestFit = current;
+			if(blockSize == size) { break; }
+		}
+	}
+	return bestFit;
+}
+
+/*
+ * Returns the first free block in list 'cls' of heap 'h' that is at least
+ * 'size' bytes, or NULL if there is none.
+ */
+static blockHeader* fl_first(heap *h, int cls, bsize_t size) {
+	blockHeader *current = h->free_lists[cls];
+	while(current != NULL && (current->size_status & ~STATUS_BITS) < size) { current = LINKS(current)->next; }
+	return current;
+}
+
+/*
+ * Like fl_first(), but starts where the last search of list 'cls' ended
+ * and wraps around to the front of the list.
+ */
+static blockHeader* fl_next(heap *h, int cls, bsize_t size) {
+	blockHeader *rover = h->rovers[cls];
+	blockHeader *current = rover;
+	while(current != NULL && (current->size_status & ~STATUS_BITS) < size) { current = LINKS(current)->next; }
+
+	// Wrap around, up to where this search started
+	if(current == NULL) {
+		current = h->free_lists[cls];
+		while(current != rover && (current->size_status & ~STATUS_BITS) < size) { current = LINKS(current)->next; }
+		if(current == rover) { current = NULL; }
+	}
+
+	// Taking the block off its list moves the rover to the block after it
+	if(current != NULL) { h->rovers[cls] = current; }
+	return current;
+}
+
+/*
+ * Like fl_best(), but stops at the first block that is at most
+ * good_fit_pct percent larger than 'size'.
+ */
+static blockHeader* fl_good(heap *h, int cls, bsize_t size) {
+	bsize_t good = size + (bsize_t)((size_t)size * good_fit_pct / 100);
+	blockHeader *bestFit = NULL;
+	bsize_t bestSize = BSIZE_MAX;
+
+	for(blockHeader *current = h->free_lists[cls]; current != NULL; current = LINKS(current)->next) {
+		bsize_t blockSize = current->size_status & ~STATUS_BITS;
+		if(blockSize >= size && (bestFit == NULL || blockSize < bestSize)) {
+			bestSize = blockSize;
+			bestFit = current;
+			if(blockSize <= good) { break; }
+		}
+	}
+	return bestFit;
+}
+
+/*
+ * Search over the free lists, with the placement policy init_heap_flags()
+ * chose (BEST-FIT unless asked otherwise, see fl_search).
+ * Only the class 'size' falls into can hold free blocks that are too small,
+ * every block in a higher class fits, so the fit is either in the
+ * request's own class or in the next non-empty class.
+ * Every tree block is larger than any list block, so the tree is only
+ * searched when no list has a fit. The tree always gives the best fit, it
+ * does so in O(log n) anyway.
+ */
+static blockHeader* find_fit(heap *h, bsize_t size) {
+	int cls = size_class(size);
+	if(cls >= TREE_CLASS) { return tree_ceil(h, size, NULL); }
+
+	blockHeader *bestFit = fl_search(h, cls, size);
+	if(bestFit != NULL) { return bestFit; }
+
+	// Classes above cls that have at least one free block
+	unsigned int higher = h->free_map & ~((2u << cls) - 1);
+	if(higher == 0) { return tree_ceil(h, size, NULL); }
+
+	return fl_search(h, __builtin_ctz(higher), size);
+}
+
+static int grow_heap(heap *h, bsize_t size);
+
+/*
+ * Returns the size of the block that holds a payload of 'request' bytes,
+ * the header added and rounded up to a multiple of ALIGNMENT.
+ * Returns 0 if the block would not fit in a bsize_t.
+ */
+static bsize_t block_size(size_t request) {
+	// Checked before adding the header so the rounding below can't overflow
+	if(request > BSIZE_MAX - HDR_SIZE) { return 0; }
+
+	// Add header bytes to size, and padding to make total block size
+	// (w/ header) a multiple of ALIGNMENT
+	bsize_t size = (request + HDR_SIZE + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+	// Block must be able to hold the free list links once it is freed
+	return size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size;
+}
+
+/*
+ * Allocates a block of 'size' bytes (a block_size()) at the start of free
+ * block 'bestFit' of heap 'h', for alloc_fit(), see there.
+ * Caller must hold h->lock.
+ * Returns address of the allocated block's payload.
+ */
+static void* place_block(heap *h, blockHeader *bestFit, bsize_t size, char **clean, size_t *clean_len) {
+	// Store size of block we found and take it off its free list
+	bsize_t totalFreeSize = bestFit->size_status & ~STATUS_BITS;
+	int released = is_released(bestFit, totalFreeSize);
+	if(released && clean != NULL) {
+		// The released pages that end up in the new block
+		char *end = (char*)bestFit + (totalFreeSize - size < MIN_BLOCK_SIZE ? totalFreeSize : size);
+		size_t len = trim_range(bestFit, totalFreeSize, clean);
+		*clean_len = *clean + len <= end ? len : end > *clean ? (size_t)(end - *clean) : 0;
+	}
+	fl_remove(h, bestFit, totalFreeSize);
+	h->used_blocks++;
+
+	// If the leftover is too small to be a block, use the whole block
+	// (just update its header and the next block's p-bit)
+	if(totalFreeSize - size < MIN_BLOCK_SIZE) {
+		bestFit->size_status += A_BIT; // set a-bit to 1
+
+		// If next header's pbit is 0, make it 1 (end mark included)
+		blockHeader* nextHeader = (blockHeader*)((char*)bestFit + totalFreeSize);
+		if((nextHeader->size_status & P_BIT) == 0) {
+			HDR_SET_PBIT(nextHeader);
+		}
+		// Return the updated block header's payload address
+		return (void*)((char*)bestFit + HDR_SIZE);
+	}
 
+	// Split bestFit block
+	// newBlock will be the inserted block
+	// bestFit will be updated to be the free block
+	bsize_t bestFitSize = totalFreeSize - size;
+
+	// Create new block of memory (keep p-bit same, a-bit is 1)
+	blockHeader* newBlock = bestFit;
+	newBlock->size_status = size + (bestFit->size_status & P_BIT) + A_BIT;
+
+	// Update bestFit's payload addr
+	bestFit = (blockHeader*)((char*)newBlock + size);
+	// Update bestFit's footer size
+	((blockHeader*)((char*)bestFit + bestFitSize - HDR_SIZE))->size_status = bestFitSize;
+	// Update bestFit's header value
+	// !! updated since p3A turn in, just better logic instead of adding 2
+	bestFit->size_status = bestFitSize | (newBlock->size_status & P_BIT);
+	// Leftover goes back on the free lists
+	fl_insert(h, bestFit, bestFitSize);
+	if(released) { mark_released(h, bestFit, bestFitSize); }
 
+	// Return payload addr of newBlock
+	return (void*)((char*)newBlock + HDR_SIZE);
+}
 
 /* 
- * Function for allocating 'size' bytes of heap memory.
+ * Allocates 'size' bytes of heap memory from the shared heap.
+ * Caller must hold h->lock.
  * Argument size: requested size for the payload
+ * Argument clean: if not NULL, set to the part of the new block whose
+ *   pages are known to be zero (a released range, see trimming), with its
+ *   length in clean_len, 0 if there is none.
  * Returns address of allocated block (payload) on success.
  * Returns NULL on failure.
  *
  * This function must:
  * - Check size - Return NULL if size < 1 
- * - Determine block size rounding up to a multiple of 8 
+ *   or if the block would not fit in a bsize_t
+ * - Determine block size rounding up to a multiple of ALIGNMENT
  *   and possibly add padding as a result.
  *
  * - Use BEST-FIT PLACEMENT POLICY to chose a free block
+ *   (only free blocks are searched, see find_fit())
  *
  * - If the BEST-FIT block that is found is exact size match
+ *   (or the leftover would be smaller than MIN_BLOCK_SIZE)
  *   - 1. Update all heap blocks as needed for any affected blocks
  *   - 2. Return the address of the allocated block payload
  *
  * - If the BEST-FIT block that is found is large enough to split 
  *   - 1. SPLIT the free block into two valid heap blocks:
  *         1. an allocated block
- *         2. a free block
+ *         2. a free block, which goes back on its free list
  *         NOTE: both blocks must meet heap block requirements 
  *       - Update all heap block header(s) and footer(s) 
  *              as needed for any affected blocks.
@@ -108,191 +973,2751 @@ char* heap_end = NULL; // Address of where the heap ends
  *       available memory for the requester.
  *
  */
-void* alloc(int size) {     
+static void* alloc_fit(heap *h, size_t request, char **clean, size_t *clean_len) {
 	//DONE: Your code goes in here.
 	// !! only changes of note since p3A are style changes
-	if(size < 1) { return NULL; }
+	if(request < 1 || heap_start == NULL) { return NULL; }
+	if(clean != NULL) { *clean_len = 0; }
+
+	// Block size with header and padding
+	bsize_t size = block_size(request);
+	if(size == 0) { return NULL; }
+
+	// A block of the same size that was freed without coalescing
+	if(size < TREE_MIN_SIZE && h->fast_bins[size / ALIGNMENT] != NULL) {
+		blockHeader *fast = h->fast_bins[size / ALIGNMENT];
+		h->fast_bins[size / ALIGNMENT] = LINKS(fast)->next;
+		h->fast_blocks--;
+		fast->size_status &= ~FAST_BIT;
+		return (void*)((char*)fast + HDR_SIZE);
+	}
+
+	// Best-Fit search over the free lists,
+	// map more memory if nothing fits and search again
+	blockHeader *bestFit = find_fit(h, size);
+	if(bestFit == NULL) {
+		if(grow_heap(h, size) != 0) { return NULL; }
+		bestFit = find_fit(h, size);
+	}
+
+	return place_block(h, bestFit, size, clean, clean_len);
+}
+
+/*
+ * alloc_fit() for callers that don't care what is zero.
+ */
+static void* alloc_block(heap *h, size_t request) {
+	return alloc_fit(h, request, NULL, NULL);
+}
+
+/*
+ * Frees the allocated block with header 'ptr_header' back to the shared heap.
+ * Caller must hold h->lock and have validated the block.
+ *
+ * If free results in two or more adjacent free blocks,
+ * they will be immediately coalesced into one larger free block.
+ * so free blocks require a footer (blockHeader works) to store the size
+ * Any neighbour that gets coalesced is taken off its free list first,
+ * and the resulting block is put on the list for its new size.
+ */
+static void release_block(heap *h, blockHeader* ptr_header) {
+	// Set ptr_header a-bit to 0/free
+	ptr_header->size_status = ptr_header->size_status & ~A_BIT;
+	h->used_blocks--;
+
+	// Init size of ptr for later use
+	bsize_t ptr_size = ptr_header->size_status & ~STATUS_BITS;
+
+	// Init next_header to point to next block's header
+	blockHeader* next_header = (blockHeader*)((char*)ptr_header + ptr_size);
+
+	// Released pages of coalesced neighbours, trim_block() skips them
+	char *prev_released_end = NULL;
+	char *next_released = NULL;
+
+	// If the next block is free, coalesce it into ptr
+	if((next_header->size_status & A_BIT) == 0) {
+		// Take next block off its free list, then add its size to ptr
+		bsize_t next_size = (next_header->size_status & ~STATUS_BITS);
+		if(is_released(next_header, next_size)) { trim_range(next_header, next_size, &next_released); }
+		fl_remove(h, next_header, next_size);
+		ptr_size += next_size;
+		ptr_header->size_status = ptr_size | (ptr_header->size_status & P_BIT);
+	}
+
+	// Check if previous block is free, if so
+	// we will coalesce it into ptr
+	if((ptr_header->size_status & P_BIT) == 0) {
+		// Get footer of previous block
+		blockHeader* prev_footer = (blockHeader*)((char*)ptr_header - HDR_SIZE);
+		// Init prev_header to point to previous block's header
+		blockHeader* prev_header = (blockHeader*)((char*)ptr_header - prev_footer->size_status);
+		// Take previous block off its free list
+		if(is_released(prev_header, prev_footer->size_status)) {
+			size_t len = trim_range(prev_header, prev_footer->size_status, &prev_released_end);
+			prev_released_end += len;
+		}
+		fl_remove(h, prev_header, prev_footer->size_status);
+
+		// Update ptr_header to be where prev_header is
+		ptr_header = prev_header;
+
+		// Update ptr's size to ptr + size of previous block
+		ptr_size += prev_footer->size_status;
+		ptr_header->size_status = ptr_size | (prev_header->size_status & P_BIT);
+
+	}
+
+	// Now that all coalescing is done, properly set p-bit of next_header
+	// (end mark included)
+	next_header = (blockHeader*)((char*)ptr_header + ptr_size);
+	HDR_CLEAR_PBIT(next_header);
+
+	// Assign a footer to ptr
+	blockHeader* ptr_footer = (blockHeader*)((char*)ptr_header + ptr_size - HDR_SIZE);
+	ptr_footer->size_status = ptr_size;
+
+	// Put the coalesced block on its free list, large ones give back their pages
+	fl_insert(h, ptr_header, ptr_size);
+	if(ptr_size >= TRIM_THRESHOLD && (heap_flags & HEAP_POPULATE) == 0) { trim_block(h, ptr_header, ptr_size, prev_released_end, next_released); }
+}
+
+/*
+ * Frees allocated block 'b' of heap 'h', onto a fast bin in a heap made
+ * with HEAP_DEFER_COALESCE, otherwise with release_block().
+ * Caller must hold h->lock and have validated the block.
+ */
+static void defer_block(heap *h, blockHeader *b) {
+	bsize_t size = b->size_status & ~STATUS_BITS;
+	if((heap_flags & HEAP_DEFER_COALESCE) == 0 || size >= TREE_MIN_SIZE) {
+		release_block(h, b);
+		return;
+	}
+
+	b->size_status |= FAST_BIT;
+	LINKS(b)->next = h->fast_bins[size / ALIGNMENT];
+	h->fast_bins[size / ALIGNMENT] = b;
+	h->fast_blocks++;
+}
+
+/*
+ * Coalesces every block in the fast bins of heap 'h', each one is freed
+ * with release_block() as if it had just been freed.
+ * Caller must hold h->lock.
+ * Returns the number of blocks that were in the bins.
+ */
+static size_t fast_consolidate(heap *h) {
+	size_t count = h->fast_blocks;
+	if(count == 0) { return 0; }
+
+	for(int i = 0; i < FAST_BINS; i++) {
+		blockHeader *b = h->fast_bins[i];
+		h->fast_bins[i] = NULL;
+		while(b != NULL) {
+			blockHeader *next = LINKS(b)->next;
+			b->size_status &= ~FAST_BIT;
+			release_block(h, b);
+			b = next;
+		}
+	}
+	h->fast_blocks = 0;
+	return count;
+}
+
+/*
+ * Sets the range of segment 'seg' to 'len' bytes at 'start'.
+ * Caller must hold heaps_lock.
+ * The entry's sequence count is odd while the two change, so unlocked
+ * find_segment() callers only ever see the old range or the new one.
+ */
+static void seg_set(heapSegment *seg, char *start, size_t len) {
+	__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&seg->start, start, __ATOMIC_RELAXED);
+	__atomic_store_n(&seg->len, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+}
+
+static heapSegment* direct_find(void *ptr);
+
+/*
+ * Returns the heap segment that contains address 'ptr', or NULL.
+ * Safe without the lock for any pointer the heap has handed out, each
+ * range is read again until no seg_set() ran during the read. Direct
+ * segments are only found by the payload of their block.
+ * Must not be called with heaps_lock held.
+ */
+static heapSegment* find_segment(void *ptr) {
+	int count = __atomic_load_n(&num_segments, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < count; i++) {
+		heapSegment *seg = &segments[i];
+		unsigned int seq;
+		char *start;
+		size_t len;
+		do {
+			seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+			start = __atomic_load_n(&seg->start, __ATOMIC_RELAXED);
+			len = __atomic_load_n(&seg->len, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while((seq & 1) != 0 || __atomic_load_n(&seg->seq, __ATOMIC_RELAXED) != seq);
+
+		if((char*)ptr >= start && (char*)ptr < start + len) { return seg; }
+	}
+	return direct_find(ptr);
+}
+
+/*
+ * Takes the first unused entry of the segment table for mapping 'start'
+ * of 'len' bytes, whose blocks belong to heap 'owner'.
+ * Returns the entry's index, or -1 if the table is full.
+ * Every entry is taken here, whatever the mapping is for.
+ */
+static int seg_claim(char *start, size_t len, heap *owner) {
+	pthread_mutex_lock(&heaps_lock);
+	int i = 0;
+	while(i < num_segments && segments[i].owner != NULL) { i++; }
+	if(i == MAX_SEGMENTS) {
+		pthread_mutex_unlock(&heaps_lock);
+		return -1;
+	}
+
+	heapSegment *seg = &segments[i];
+	seg->direct = 0;
+	seg->owner = owner;
+	seg_set(seg, start, len);
+	if(i == num_segments) { __atomic_store_n(&num_segments, i + 1, __ATOMIC_RELEASE); }
+	pthread_mutex_unlock(&heaps_lock);
+	return i;
+}
+
+/*
+ * Adds 'len' bytes of newly mapped memory right after segment 'seg'.
+ * Caller must hold h->lock.
+ * The old end mark becomes the header of the new space, which is then freed
+ * like any other block, so it is coalesced with a free last block.
+ */
+static void seg_append(heap *h, heapSegment *seg, size_t len) {
+	blockHeader *new_block = SEG_END_MARK(seg);
+	new_block->size_status = len | (new_block->size_status & P_BIT) | A_BIT;
+
+	pthread_mutex_lock(&heaps_lock);
+	seg_set(seg, seg->start, seg->len + len);
+	pthread_mutex_unlock(&heaps_lock);
+	SEG_END_MARK(seg)->size_status = P_BIT | A_BIT;
+	if(seg == &segments[0]) { heap_end += len; }
+	__atomic_add_fetch(&alloc_size, len, __ATOMIC_RELAXED);
+
+	// Counted as allocated until release_block() frees it
+	h->used_blocks++;
+	release_block(h, new_block);
+}
+
+/*
+ * Grows segment 'seg' by at least 'size' bytes with mremap, the new space
+ * is added after its last block like seg_append() does.
+ * Caller must hold h->lock.
+ * Argument may_move: the segment holds a single allocated block, so the
+ *   O.S. may move the whole mapping (and the block with it, without
+ *   copying). Otherwise the mapping can only grow where it is.
+ * Returns 0 on success, the segment's start may have changed.
+ * Returns -1 if the mapping can't grow.
+ */
+static int seg_remap(heap *h, heapSegment *seg, bsize_t size, int may_move) {
+	size_t pagesize = map_page;
+	size_t len = ((size_t)size + pagesize - 1) / pagesize * pagesize;
+
+	// Merged segment must still fit in a single block
+	if(seg->len + len > (size_t)BSIZE_MAX) { return -1; }
+
+	// A free last block is on a free list, take it off while its address may change
+	blockHeader *end_mark = SEG_END_MARK(seg);
+	blockHeader *last_free = NULL;
+	bsize_t last_size = 0;
+	if(may_move && (end_mark->size_status & P_BIT) == 0) {
+		last_size = ((blockHeader*)((char*)end_mark - HDR_SIZE))->size_status;
+		last_free = (blockHeader*)((char*)end_mark - last_size);
+		fl_remove(h, last_free, last_size);
+	}
+
+	// Empty while it may move, as in direct_resize(), so find_segment()
+	// never matches the old range once it is unmapped
+	char *old_start = seg->start;
+	size_t old_len = seg->len;
+	pthread_mutex_lock(&heaps_lock);
+	if(may_move) { seg_set(seg, old_start, 0); }
+
+	char *start = mremap(old_start, old_len, old_len + len, may_move ? MREMAP_MAYMOVE : 0);
+	if(MAP_FAILED == start) {
+		if(may_move) { seg_set(seg, old_start, old_len); }
+		pthread_mutex_unlock(&heaps_lock);
+		if(last_free != NULL) { fl_insert(h, last_free, last_size); }
+		return -1;
+	}
+
+	// The old length at the new start, the new space is added after
+	seg_set(seg, start, old_len);
+	pthread_mutex_unlock(&heaps_lock);
+
+	if(last_free != NULL) {
+		fl_insert(h, (blockHeader*)(start + ((char*)last_free - old_start)), last_size);
+	}
+
+	// Without table nodes the blocks there could never be freed, but the
+	// mapping can't be undone now, so this only fails if memory runs out
+	starts_map(start, old_len + len);
+
+	seg_append(h, seg, len);
+
+	return 0;
+}
+
+/*
+ * Sets the memory policy of new mapping 'addr' of heap 'h' to prefer the
+ * heap's NUMA node. Preferred rather than strict, so a full node falls back
+ * to other nodes instead of failing. Does nothing on single node systems.
+ */
+static void bind_memory(heap *h, void *addr, size_t len) {
+	if(h->node < 0 || h->node >= 64 || num_nodes < 2) { return; }
+
+	unsigned long mask = 1ul << h->node;
+	syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+/*
+ * Maps 'len' bytes, a multiple of map_page, for heap 'h', at 'hint' if the
+ * O.S. agrees, with the options init_heap_flags() was given:
+ * - HEAP_HUGETLB(_1G) maps huge pages from the hugetlb pool. If the pool
+ *   has none left this falls back to transparent huge pages.
+ * - HEAP_HUGEPAGE (or the fallback) maps normal memory aligned to the huge
+ *   page size and asks for huge pages with madvise(MADV_HUGEPAGE), which
+ *   the kernel gives when it can.
+ * - HEAP_POPULATE faults every page in right away. This is done after the
+ *   madvise() and mbind() calls, so unlike MAP_POPULATE the pages it
+ *   faults in are huge and on the right node.
+ * Returns the mapping, or MAP_FAILED.
+ */
+static char* map_memory(heap *h, char *hint, size_t len) {
+	size_t pagesize = getpagesize();
+	char *ptr = MAP_FAILED;
+
+	if(heap_flags & (HEAP_HUGETLB | HEAP_HUGETLB_1G)) {
+		int huge = MAP_HUGETLB | ((heap_flags & HEAP_HUGETLB_1G) ? MAP_HUGE_1GB : 0);
+		ptr = mmap(hint, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | huge, -1, 0);
+	}
+
+	if(MAP_FAILED == ptr) {
+		ptr = mmap(hint, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(MAP_FAILED == ptr) { return ptr; }
+
+		// Transparent huge pages need a huge page aligned range, map a
+		// huge page more than needed and cut off both ends
+		if(map_page > pagesize && (uintptr_t)ptr % map_page != 0) {
+			munmap(ptr, len);
+			char *big = mmap(NULL, len + map_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(MAP_FAILED == big) { return big; }
+
+			ptr = (char*)(((uintptr_t)big + map_page - 1) & ~(uintptr_t)(map_page - 1));
+			if(ptr > big) { munmap(big, ptr - big); }
+			munmap(ptr + len, big + map_page - ptr);
+		}
+		if(map_page > pagesize) { madvise(ptr, len, MADV_HUGEPAGE); }
+	}
+
+	if(starts_map(ptr, len) != 0) {
+		munmap(ptr, len);
+		return MAP_FAILED;
+	}
+	bind_memory(h, ptr, len);
+
+	if(heap_flags & HEAP_POPULATE) {
+#ifdef MADV_POPULATE_WRITE
+		if(madvise(ptr, len, MADV_POPULATE_WRITE) == 0) { return ptr; }
+#endif
+		// Older kernels, touch every page
+		for(size_t off = 0; off < len; off += pagesize) { ptr[off] = 0; }
+	}
+	return ptr;
+}
+
+/*
+ * Maps more memory for heap 'h' so that a free block of at least 'size'
+ * bytes exists.
+ * Caller must hold h->lock.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ *
+ * The new mapping is requested right after the heap's last segment, but the
+ * O.S. usually places new mappings right below the previous one, so both
+ * are merged when they happen (only with segments of the same heap):
+ * - Right after a segment, its old end mark becomes the header of the new
+ *   space.
+ * - Right before a segment (other than the first, heap_start never moves),
+ *   the new space becomes that segment's first block.
+ * Anything else becomes a new segment with its own end mark.
+ * In all cases the new space is then freed like any other block, so it is
+ * coalesced with a free neighbour and put on the free lists.
+ */
+static int grow_heap(heap *h, bsize_t size) {
+	// Coalescing the fast bins may already make a free block that fits
+	if(fast_consolidate(h) > 0 && find_fit(h, size) != NULL) { return 0; }
+
+	// heap_create() heaps are a single mapping
+	if(!IS_SHARED(h)) { return -1; }
+
+	size_t pagesize = map_page;
+	char *hint = NULL;
+	if(h->last_seg >= 0) {
+		heapSegment *last = &segments[h->last_seg];
+		hint = last->start + last->len;
+	}
+
+	// Room for the block plus pad and end mark of a new segment, in pages
+	if((size_t)size > BSIZE_MAX - ALIGNMENT - pagesize) { return -1; }
+	size_t len = (size_t)size + ALIGNMENT;
+	if(len < GROW_MIN) { len = GROW_MIN; }
+	len = (len + pagesize - 1) / pagesize * pagesize;
+
+	char *mmap_ptr = map_memory(h, hint, len);
+	if(MAP_FAILED == mmap_ptr) { return -1; }
+
+	// Look for a segment of this heap the new mapping is adjacent to, large
+	// blocks get a segment of their own so realloc_block() can mremap them
+	int count = __atomic_load_n(&num_segments, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < count && size < MREMAP_MIN; i++) {
+		heapSegment *seg = &segments[i];
+		if(seg->owner != h) { continue; }
+
+		// Merged segment must still fit in a single block
+		if(seg->len + len > (size_t)BSIZE_MAX) { continue; }
+
+		if(seg->start + seg->len == mmap_ptr) {
+			// Old end mark becomes the header of a block of len bytes
+			seg_append(h, seg, len);
+			return 0;
+		}
+
+		if(mmap_ptr + len == seg->start && i != 0) {
+			// New first block runs up to the old first block
+			blockHeader *new_block = (blockHeader*)(mmap_ptr + SEG_PAD);
+			new_block->size_status = len | P_BIT | A_BIT;
+			pthread_mutex_lock(&heaps_lock);
+			seg_set(seg, mmap_ptr, seg->len + len);
+			pthread_mutex_unlock(&heaps_lock);
+			__atomic_add_fetch(&alloc_size, len, __ATOMIC_RELAXED);
+
+			h->used_blocks++;
+			release_block(h, new_block);
+			return 0;
+		}
+	}
+
+	// New segment, skip first SEG_PAD bytes for alignment. Its blocks are
+	// set up before the entry is claimed, nothing can point into it yet
+	blockHeader *new_block = (blockHeader*)(mmap_ptr + SEG_PAD);
+	new_block->size_status = (len - ALIGNMENT) | P_BIT | A_BIT;
+	((blockHeader*)(mmap_ptr + len - HDR_SIZE))->size_status = P_BIT | A_BIT;
+
+	int i = seg_claim(mmap_ptr, len, h);
+	if(i < 0) {
+		munmap(mmap_ptr, len);
+		return -1;
+	}
+	h->last_seg = i;
+	__atomic_add_fetch(&alloc_size, len - ALIGNMENT, __ATOMIC_RELAXED);
+
+	h->used_blocks++;
+	release_block(h, new_block);
+	return 0;
+}
+
+/*
+ * Direct mappings for large blocks.
+ *
+ * Requests of direct_min bytes and up (1 MiB, unless init_heap_flags() was
+ * given HEAP_DIRECT_MIN) don't go through the free lists. Each one gets a
+ * mapping of its own, a segment that holds nothing but its block:
+ *
+ *   [heapSegment][SEG_PAD bytes][the block][end mark]
+ *
+ * So a huge buffer never splits a free block that smaller requests could
+ * have used, and freeing it gives all of it back at once instead of
+ * leaving a hole in the heap. Its heapSegment (tagged direct, the compact
+ * header has no status bit left for it) lives at the front of the mapping,
+ * not in segments[], so direct blocks never use up the segment table or
+ * make find_segment() scan longer. They are found through direct_table
+ * instead, a hash table keyed by payload address that grows as needed.
+ * realloc_block() resizes the whole mapping with mremap().
+ *
+ * Unmapping costs a system call, and mapping again another one plus a
+ * page fault for every page. The mappings freed last are kept in
+ * direct_cache instead, at most DIRECT_CACHE of them and DIRECT_CACHE_BYTES
+ * in all, and the next request they fit (without being more than half
+ * again as large) gets one of them. heap_trim() unmaps them.
+ * The cache and direct_table are protected by heaps_lock.
+ *
+ * A direct block belongs to the heap of the thread that allocated it, but
+ * that heap's lock is never taken for it, so heap_check() skips direct
+ * segments (disp_heap() holds heaps_lock as well).
+ */
+#define DIRECT_MIN (1024 * 1024)
+#define DIRECT_CACHE 8
+#define DIRECT_CACHE_BYTES (64 * 1024 * 1024)
+
+typedef struct directMap {
+    char *start;
+    size_t len;
+} directMap;
+
+// Room for the heapSegment in front of the segment proper
+#define DIRECT_META ((sizeof(heapSegment) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+// Mapping of direct segment 'seg'
+#define DIRECT_MAP(seg) ((seg)->start - DIRECT_META)
+
+// Removed entry of direct_table, probing goes on past it
+#define DIRECT_GONE ((heapSegment*)1)
+
+static size_t direct_min = DIRECT_MIN;
+static directMap direct_cache[DIRECT_CACHE];    // oldest first
+static int direct_cached = 0;
+static size_t direct_cache_bytes = 0;
+
+// Direct segments, open addressing with linear probing, mapped with mmap()
+static heapSegment **direct_table = NULL;
+static size_t direct_mask = 0;          // size - 1, a power of 2
+static size_t direct_count = 0;         // segments in it, atomic
+static size_t direct_gone = 0;          // DIRECT_GONE entries in it
+
+static size_t direct_hash(void *payload) {
+	return (size_t)(((uintptr_t)payload >> 12) * 0x9e3779b97f4a7c15ull >> 20) & direct_mask;
+}
+
+/*
+ * Moves direct_table to a new table of 'size' entries, a power of 2.
+ * Caller must hold heaps_lock.
+ * Returns 0 on success, -1 if it can't be mapped (the old one stays).
+ */
+static int direct_rehash(size_t size) {
+	heapSegment **table = mmap(NULL, size * sizeof(heapSegment*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(MAP_FAILED == table) { return -1; }
+
+	heapSegment **old = direct_table;
+	size_t old_size = old != NULL ? direct_mask + 1 : 0;
+	direct_table = table;
+	direct_mask = size - 1;
+	direct_gone = 0;
+	for(size_t i = 0; i < old_size; i++) {
+		if(old[i] == NULL || old[i] == DIRECT_GONE) { continue; }
+		size_t j = direct_hash(old[i]->start + ALIGNMENT);
+		while(table[j] != NULL) { j = (j + 1) & direct_mask; }
+		table[j] = old[i];
+	}
+	if(old != NULL) { munmap(old, old_size * sizeof(heapSegment*)); }
+	return 0;
+}
+
+/*
+ * Adds direct segment 'seg' to direct_table.
+ * Caller must hold heaps_lock.
+ * Returns 0 on success, -1 if the table is full and can't grow. Never
+ * fails right after a direct_remove().
+ */
+static int direct_insert(heapSegment *seg) {
+	// At most half full, counting removed entries
+	size_t size = direct_table != NULL ? direct_mask + 1 : 0;
+	if(2 * (direct_count + direct_gone + 1) > size) {
+		size_t want = 64;
+		while(want < 4 * (direct_count + 1)) { want *= 2; }
+		// Keep going in the old table while it has a free entry left
+		if(direct_rehash(want) != 0 && direct_count == size) { return -1; }
+	}
+
+	size_t i = direct_hash(seg->start + ALIGNMENT);
+	while(direct_table[i] != NULL && direct_table[i] != DIRECT_GONE) { i = (i + 1) & direct_mask; }
+	if(direct_table[i] == DIRECT_GONE) { direct_gone--; }
+	direct_table[i] = seg;
+	__atomic_store_n(&direct_count, direct_count + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Takes direct segment 'seg' out of direct_table.
+ * Caller must hold heaps_lock.
+ */
+static void direct_remove(heapSegment *seg) {
+	size_t i = direct_hash(seg->start + ALIGNMENT);
+	while(direct_table[i] != seg) { i = (i + 1) & direct_mask; }
+	direct_table[i] = DIRECT_GONE;
+	direct_gone++;
+	__atomic_store_n(&direct_count, direct_count - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the direct segment whose block has payload 'ptr', or NULL.
+ * Takes heaps_lock, unless there are no direct blocks at all.
+ */
+static heapSegment* direct_find(void *ptr) {
+	if(__atomic_load_n(&direct_count, __ATOMIC_RELAXED) == 0) { return NULL; }
+
+	heapSegment *found = NULL;
+	pthread_mutex_lock(&heaps_lock);
+	// Bounded, as a table that failed to grow may have no empty entry left
+	size_t i = direct_hash(ptr);
+	for(size_t n = 0; n <= direct_mask && direct_table[i] != NULL; n++, i = (i + 1) & direct_mask) {
+		if(direct_table[i] != DIRECT_GONE && direct_table[i]->start + ALIGNMENT == (char*)ptr) {
+			found = direct_table[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&heaps_lock);
+	return found;
+}
+
+/*
+ * Takes entry 'i' out of direct_cache and returns it.
+ * Caller must hold heaps_lock.
+ */
+static directMap direct_take(int i) {
+	directMap map = direct_cache[i];
+	direct_cache_bytes -= map.len;
+	direct_cached--;
+	memmove(&direct_cache[i], &direct_cache[i + 1], (direct_cached - i) * sizeof(directMap));
+	return map;
+}
+
+/*
+ * Returns the length of the direct mapping for 'request' bytes, or 0 if
+ * its block would not fit in a bsize_t.
+ */
+static size_t direct_len(size_t request) {
+	bsize_t size = block_size(request);
+	if(size == 0 || (size_t)size > BSIZE_MAX - DIRECT_META - ALIGNMENT - map_page) { return 0; }
+
+	// Segment entry, pad and end mark, in whole pages
+	return ((size_t)size + DIRECT_META + ALIGNMENT + map_page - 1) / map_page * map_page;
+}
+
+/*
+ * Allocates a block of 'request' bytes for heap 'h' in a mapping of its
+ * own, see above.
+ * Sets 'clean' like alloc_fit() does, all of a new mapping is zero.
+ * Returns address of the payload on success.
+ * Returns NULL if no mapping can be had, the request goes to the heap then.
+ */
+static void* direct_alloc(heap *h, size_t request, char **clean, size_t *clean_len) {
+	size_t len = direct_len(request);
+	if(len == 0) { return NULL; }
+
+	// Smallest cached mapping that is large enough, but not much larger
+	char *start = MAP_FAILED;
+	pthread_mutex_lock(&heaps_lock);
+	int best = -1;
+	for(int i = 0; i < direct_cached; i++) {
+		size_t cached = direct_cache[i].len;
+		if(cached >= len && cached - len <= len / 2 && (best < 0 || cached < direct_cache[best].len)) { best = i; }
+	}
+	if(best >= 0) {
+		directMap map = direct_take(best);
+		start = map.start;
+		len = map.len;
+	}
+	pthread_mutex_unlock(&heaps_lock);
+
+	if(MAP_FAILED == start) {
+		start = map_memory(h, NULL, len);
+		if(MAP_FAILED == start) { return NULL; }
+
+		*clean = start + DIRECT_META + ALIGNMENT;
+		*clean_len = len - DIRECT_META - ALIGNMENT - HDR_SIZE;
+	}
+
+	heapSegment *seg = (heapSegment*)start;
+	seg->start = start + DIRECT_META;
+	seg->len = len - DIRECT_META;
+	seg->owner = h;
+	seg->direct = 1;
+	seg->seq = 0;
+
+	blockHeader *b = (blockHeader*)(seg->start + SEG_PAD);
+	b->size_status = (seg->len - ALIGNMENT) | P_BIT | A_BIT;
+	SEG_END_MARK(seg)->size_status = P_BIT | A_BIT;
+
+	pthread_mutex_lock(&heaps_lock);
+	int ret = direct_insert(seg);
+	pthread_mutex_unlock(&heaps_lock);
+	if(ret != 0) {
+		munmap(start, len);
+		*clean_len = 0;
+		return NULL;
+	}
+	__atomic_add_fetch(&alloc_size, seg->len - ALIGNMENT, __ATOMIC_RELAXED);
+
+	return seg->start + ALIGNMENT;
+}
+
+/*
+ * Frees the block of direct segment 'seg', which has been validated.
+ * The mapping goes into direct_cache, pushing the oldest ones out when
+ * the cache is full, unless it is too large to be worth keeping.
+ */
+static void direct_free(heapSegment *seg) {
+	directMap map = { DIRECT_MAP(seg), seg->len + DIRECT_META };
+	directMap unmap[DIRECT_CACHE + 1];
+	int count = 0;
+
+	pthread_mutex_lock(&heaps_lock);
+	// The entry stops matching before the memory is reused or goes away
+	direct_remove(seg);
+
+	if(map.len <= DIRECT_CACHE_BYTES / 4) {
+		while(direct_cached == DIRECT_CACHE || direct_cache_bytes + map.len > DIRECT_CACHE_BYTES) {
+			unmap[count++] = direct_take(0);
+		}
+		direct_cache[direct_cached++] = map;
+		direct_cache_bytes += map.len;
+	}
+	else {
+		unmap[count++] = map;
+	}
+	pthread_mutex_unlock(&heaps_lock);
+	__atomic_sub_fetch(&alloc_size, map.len - DIRECT_META - ALIGNMENT, __ATOMIC_RELAXED);
+
+	// No lock needed for the system calls
+	for(int i = 0; i < count; i++) { munmap(unmap[i].start, unmap[i].len); }
+}
+
+/*
+ * Resizes the block of direct segment 'seg' to hold 'request' bytes by
+ * remapping the segment, which may move it (without copying).
+ * Returns the block's payload, moved or not.
+ * Returns NULL if the request is too small for a direct mapping (it
+ * belongs in the heap then) or the mapping can't be resized.
+ */
+static void* direct_resize(heapSegment *seg, size_t request) {
+	size_t len = request >= direct_min ? direct_len(request) : 0;
+	if(len == 0) { return NULL; }
+	if(len == seg->len + DIRECT_META) { return seg->start + ALIGNMENT; }
+
+	// Out of the table while it moves (its entry moves with it), so
+	// direct_find() never matches it with a new mapping of another thread
+	// that lands where it was
+	pthread_mutex_lock(&heaps_lock);
+	size_t old_len = seg->len;
+	direct_remove(seg);
+
+	char *start = mremap(DIRECT_MAP(seg), old_len + DIRECT_META, len, MREMAP_MAYMOVE);
+	if(MAP_FAILED == start) {
+		// One entry was just taken out, so there is room for it
+		direct_insert(seg);
+		pthread_mutex_unlock(&heaps_lock);
+		return NULL;
+	}
+
+	// As in seg_remap(), this only fails if memory runs out
+	starts_map(start, len);
+
+	seg = (heapSegment*)start;
+	seg->start = start + DIRECT_META;
+	seg->len = len - DIRECT_META;
+	((blockHeader*)(seg->start + SEG_PAD))->size_status = (seg->len - ALIGNMENT) | P_BIT | A_BIT;
+	SEG_END_MARK(seg)->size_status = P_BIT | A_BIT;
+	__atomic_add_fetch(&alloc_size, seg->len - old_len, __ATOMIC_RELAXED);
+
+	direct_insert(seg);
+	pthread_mutex_unlock(&heaps_lock);
+
+	return seg->start + ALIGNMENT;
+}
+
+/*
+ * Returns the NUMA node of the CPU this thread runs on, or -1.
+ */
+static int current_node(void) {
+	unsigned int cpu, node;
+	if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0) { return -1; }
+	return node;
+}
+
+/*
+ * Returns the heap this thread allocates from, binding the thread to one
+ * at its first call: the heap of the CPU it runs on, made if that CPU has
+ * none yet. With P3_THREAD_HEAPS each thread takes the next heap instead.
+ * When all MAX_HEAPS heaps exist, new CPUs share them round robin.
+ */
+static heap* thread_heap(void) {
+	if(thread_heap_ptr != NULL) { return thread_heap_ptr; }
+
+	pthread_mutex_lock(&heaps_lock);
+
+#ifdef P3_THREAD_HEAPS
+	static int next_heap = 0;
+	int id = next_heap++ % MAX_HEAPS;
+#else
+	int cpu = sched_getcpu();
+	if(cpu < 0) { cpu = 0; }
+	cpu %= MAX_CPUS;
+
+	if(cpu_heaps[cpu] == 0) {
+		static int next_heap = 0;
+		cpu_heaps[cpu] = next_heap++ % MAX_HEAPS + 1;
+	}
+	int id = cpu_heaps[cpu] - 1;
+#endif
+
+	// New heaps are empty, their first alloc() maps their first segment
+	heap *h = &heaps[id];
+	if(id >= num_heaps) {
+		pthread_mutex_init(&h->lock, NULL);
+		h->id = id;
+		h->node = current_node();
+		h->last_seg = -1;
+		__atomic_store_n(&num_heaps, id + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&heaps_lock);
+
+	thread_heap_ptr = h;
+	return h;
+}
+
+/*
+ * Returns the heap that in use pointer 'ptr' belongs to.
+ */
+static heap* ptr_heap(void *ptr) {
+	return find_segment(ptr)->owner;
+}
+
+/*
+ * Slab layer for small objects.
+ *
+ * Requests of up to SLAB_MAX_SIZE bytes are served from slab pages instead
+ * of heap blocks. A slab page is SLAB_PAGE bytes, SLAB_PAGE aligned, and is
+ * split into fixed-size slots of one size class. Slots have no header, the
+ * page header at the start of the page holds the slot size and a bitmap of
+ * the slots in use, so both alloc and free of a slot are O(1).
+ *
+ * Pages are carved out of spans of SLAB_SPAN_PAGES pages, and each span is
+ * one ordinary allocated block taken from the heap with alloc_block().
+ * free_block() recognizes slab slots by the address range of the spans.
+ * Spans are never given back to the heap, an empty page goes back to a pool
+ * of unused pages shared by all size classes.
+ *
+ * Every heap has its own pages and pool, which are protected by its lock.
+ * The span table is shared, it is only ever appended to (under heaps_lock),
+ * so slab_find() is safe without any lock.
+ *
+ * Building with -DP3_OOB_META keeps the page headers out of band instead:
+ * each span has a dense array of them in a block of its own, indexed by
+ * the page's offset in the span, and the pages hold nothing but slots. So
+ * alloc and free of a slot only touch that array, and a buffer overrun in
+ * a slot can hit other slots but never the allocator's metadata. Slabs
+ * then serve every size the thread caches do (up to TC_MAX_SIZE), so all
+ * of those requests are header free. Heap blocks keep their headers and
+ * footers either way, coalescing needs them next to the blocks.
+ */
+#ifdef P3_OOB_META
+#define SLAB_MAX_SIZE 256
+#else
+#define SLAB_MAX_SIZE 64
+#endif
+#define SLAB_PAGE 4096
+#define SLAB_SPAN_PAGES 64
+#define MAX_SLAB_SPANS 1024
+
+// Smallest slot, a cached slot has to hold a thread cache entry
+#define SLAB_MIN_SLOT ((16 + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#define SLAB_CLASSES ((SLAB_MAX_SIZE - SLAB_MIN_SLOT) / ALIGNMENT + 1)
+#define SLAB_MAP_WORDS (SLAB_PAGE / SLAB_MIN_SLOT / 64 + 1)
+
+typedef struct slabPage {
+    struct slabPage *next;  // next page of the class with free slots, or in the pool
+    struct slabPage *prev;
+    char *slots;            // first slot of the page
+    int slot_size;          // 0 while the page is in the pool
+    int capacity;           // number of slots in the page
+    int used;               // number of slots handed out
+    uint64_t map[SLAB_MAP_WORDS]; // bit i set => slot i is in use
+} slabPage;
+
+// Offset of the first slot in a page
+#ifdef P3_OOB_META
+#define SLAB_SLOTS_OFFSET 0
+#else
+#define SLAB_SLOTS_OFFSET ((sizeof(slabPage) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#endif
+
+typedef struct slabSpan {
+    char *start;            // first page, SLAB_PAGE aligned
+    char *end;
+#ifdef P3_OOB_META
+    slabPage *pages;        // header of each page
+#endif
+} slabSpan;
+
+static slabSpan slab_spans[MAX_SLAB_SPANS];
+static int num_slab_spans = 0;
+static char *slab_lo = NULL; // lowest and highest address of any span, atomic
+static char *slab_hi = NULL;
+
+static slabPage *slab_partial[MAX_HEAPS][SLAB_CLASSES]; // pages with free slots, per heap and class
+static slabPage *slab_pool[MAX_HEAPS];                  // unused pages, per heap
+
+/*
+ * Returns the slot size used for requests of 'size' bytes.
+ */
+static bsize_t slab_slot_size(size_t size) {
+	if(size < SLAB_MIN_SLOT) { size = SLAB_MIN_SLOT; }
+	return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+/*
+ * Returns the slab page that slot 'ptr' lives in, or NULL if 'ptr' is not
+ * in a slab span.
+ */
+static slabPage* slab_find(void *ptr) {
+	char *p = ptr;
+	if(p < __atomic_load_n(&slab_lo, __ATOMIC_RELAXED) || p >= __atomic_load_n(&slab_hi, __ATOMIC_RELAXED)) { return NULL; }
+
+	int count = __atomic_load_n(&num_slab_spans, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < count; i++) {
+		if(p >= slab_spans[i].start && p < slab_spans[i].end) {
+#ifdef P3_OOB_META
+			return &slab_spans[i].pages[(p - slab_spans[i].start) / SLAB_PAGE];
+#else
+			return (slabPage*)((uintptr_t)p & ~(uintptr_t)(SLAB_PAGE - 1));
+#endif
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns the index of slot 'ptr' in 'page', or -1 if 'ptr' is not the
+ * start of a slot that is in use.
+ */
+static int slab_slot_index(slabPage *page, void *ptr) {
+	// Any thread checks slots, the page's heap changes them under its lock
+	char *first = page->slots;
+	int slot_size = __atomic_load_n(&page->slot_size, __ATOMIC_RELAXED);
+	if(slot_size == 0 || (char*)ptr < first) { return -1; }
+
+	size_t offset = (char*)ptr - first;
+	int idx = offset / slot_size;
+	if(offset % slot_size != 0 || idx >= __atomic_load_n(&page->capacity, __ATOMIC_RELAXED)) { return -1; }
+	if((__atomic_load_n(&page->map[idx / 64], __ATOMIC_RELAXED) & (1ull << (idx % 64))) == 0) { return -1; }
+
+	return idx;
+}
+
+/*
+ * Takes a new span from heap 'h' and adds its pages to the heap's pool.
+ * Caller must hold h->lock.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+static int slab_new_span(heap *h) {
+	if(__atomic_load_n(&num_slab_spans, __ATOMIC_ACQUIRE) == MAX_SLAB_SPANS) { return -1; }
+
+	// One extra page so the span can be aligned to SLAB_PAGE
+	char *block = alloc_block(h, (SLAB_SPAN_PAGES + 1) * SLAB_PAGE - ALIGNMENT);
+	if(block == NULL) { return -1; }
+
+#ifdef P3_OOB_META
+	slabPage *pages = alloc_block(h, SLAB_SPAN_PAGES * sizeof(slabPage));
+	if(pages == NULL) {
+		release_block(h, (blockHeader*)(block - HDR_SIZE));
+		return -1;
+	}
+#endif
+
+	// The span table is shared by all heaps
+	pthread_mutex_lock(&heaps_lock);
+	if(num_slab_spans == MAX_SLAB_SPANS) {
+		pthread_mutex_unlock(&heaps_lock);
+		release_block(h, (blockHeader*)(block - HDR_SIZE));
+#ifdef P3_OOB_META
+		release_block(h, (blockHeader*)((char*)pages - HDR_SIZE));
+#endif
+		return -1;
+	}
+
+	slabSpan *span = &slab_spans[num_slab_spans];
+	span->start = (char*)(((uintptr_t)block + SLAB_PAGE - 1) & ~(uintptr_t)(SLAB_PAGE - 1));
+	span->end = span->start + SLAB_SPAN_PAGES * SLAB_PAGE;
+#ifdef P3_OOB_META
+	span->pages = pages;
+#endif
+
+	for(char *p = span->start; p < span->end; p += SLAB_PAGE) {
+#ifdef P3_OOB_META
+		slabPage *page = &pages[(p - span->start) / SLAB_PAGE];
+#else
+		slabPage *page = (slabPage*)p;
+#endif
+		page->slots = p + SLAB_SLOTS_OFFSET;
+		page->slot_size = 0;
+		page->next = slab_pool[h->id];
+		slab_pool[h->id] = page;
+	}
+
+	if(slab_lo == NULL || span->start < slab_lo) { __atomic_store_n(&slab_lo, span->start, __ATOMIC_RELAXED); }
+	if(span->end > slab_hi) { __atomic_store_n(&slab_hi, span->end, __ATOMIC_RELAXED); }
+	__atomic_store_n(&num_slab_spans, num_slab_spans + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&heaps_lock);
+
+	return 0;
+}
+
+/*
+ * Allocates one slot of class 'cls' from heap 'h'.
+ * Caller must hold h->lock.
+ * Returns the slot, or NULL if no slab page can be made.
+ */
+static void* slab_alloc(heap *h, int cls) {
+	slabPage **partial = slab_partial[h->id];
+	slabPage *page = partial[cls];
+
+	// No page with free slots, set up one from the pool
+	if(page == NULL) {
+		if(slab_pool[h->id] == NULL && slab_new_span(h) != 0) { return NULL; }
+
+		page = slab_pool[h->id];
+		slab_pool[h->id] = page->next;
+
+		// The map is cleared before slot_size says the page is in use
+		int slot_size = SLAB_MIN_SLOT + cls * ALIGNMENT;
+		for(int w = 0; w < SLAB_MAP_WORDS; w++) { __atomic_store_n(&page->map[w], 0, __ATOMIC_RELAXED); }
+		__atomic_store_n(&page->capacity, (SLAB_PAGE - SLAB_SLOTS_OFFSET) / slot_size, __ATOMIC_RELAXED);
+		__atomic_store_n(&page->slot_size, slot_size, __ATOMIC_RELAXED);
+		page->used = 0;
+
+		page->prev = NULL;
+		page->next = NULL;
+		partial[cls] = page;
+	}
+
+	// First slot that is not in use
+	int w = 0;
+	while(page->map[w] == ~0ull) { w++; }
+	int idx = w * 64 + __builtin_ctzll(~page->map[w]);
+
+	__atomic_store_n(&page->map[w], page->map[w] | 1ull << (idx % 64), __ATOMIC_RELAXED);
+
+	// Full pages leave the partial list
+	if(++page->used == page->capacity) {
+		partial[cls] = page->next;
+		if(page->next != NULL) { page->next->prev = NULL; }
+	}
+
+	return page->slots + (size_t)idx * page->slot_size;
+}
+
+/*
+ * Frees slot 'idx' of 'page', which belongs to heap 'h'.
+ * Caller must hold h->lock and have validated the slot.
+ */
+static void slab_free(heap *h, slabPage *page, int idx) {
+	slabPage **partial = slab_partial[h->id];
+	int cls = (page->slot_size - SLAB_MIN_SLOT) / ALIGNMENT;
+
+	__atomic_store_n(&page->map[idx / 64], page->map[idx / 64] & ~(1ull << (idx % 64)), __ATOMIC_RELAXED);
+
+	// Page was full, it has a free slot again
+	if(page->used-- == page->capacity) {
+		page->prev = NULL;
+		page->next = partial[cls];
+		if(page->next != NULL) { page->next->prev = page; }
+		partial[cls] = page;
+	}
+
+	// Empty pages go back to the pool, unless it is the last one of the class
+	if(page->used == 0 && (page->prev != NULL || page->next != NULL)) {
+		if(page->prev != NULL) { page->prev->next = page->next; }
+		else { partial[cls] = page->next; }
+		if(page->next != NULL) { page->next->prev = page->prev; }
+
+		__atomic_store_n(&page->slot_size, 0, __ATOMIC_RELAXED);
+		page->next = slab_pool[h->id];
+		slab_pool[h->id] = page;
+	}
+}
+
+/*
+ * Frees 'ptr' back to whichever layer it came from, slab or heap.
+ * Caller must hold h->lock and have validated 'ptr'.
+ */
+static void release_ptr(heap *h, void *ptr) {
+	slabPage *page = slab_find(ptr);
+	if(page != NULL) {
+		slab_free(h, page, slab_slot_index(page, ptr));
+	}
+	else {
+		defer_block(h, (blockHeader*)((char*)ptr - HDR_SIZE));
+	}
+}
+
+/*
+ * Pending frees.
+ *
+ * A freed pointer can sit in a thread cache or on a remote list for a
+ * while before its heap releases it, and its header (or slab bitmap) still
+ * says it is in use until then. So that a second free from any thread is
+ * caught in the meantime, the second word of its payload holds
+ * pending_cookie, one random value for the whole process. A payload in use
+ * only matches it by a 1 in 2^63 chance.
+ */
+#define PENDING_KEY(ptr) (((void**)(ptr)) + 1)
+
+// Random and odd, so no payload pointer matches it by chance
+static void *pending_cookie = (void*)1;
+
+/*
+ * Picks pending_cookie, from the kernel's random bytes if it has any.
+ */
+static void pending_make_cookie(void) {
+	uintptr_t cookie = 0;
+	if(syscall(SYS_getrandom, &cookie, sizeof(cookie), 0) != sizeof(cookie)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		cookie = ((uintptr_t)ts.tv_nsec ^ (uintptr_t)&cookie) * 0x9e3779b97f4a7c15ull;
+	}
+	pending_cookie = (void*)(cookie | 1);
+}
+
+static void pending_set(void *ptr) {
+	__atomic_store_n(PENDING_KEY(ptr), pending_cookie, __ATOMIC_RELAXED);
+}
+
+static void pending_clear(void *ptr) {
+	__atomic_store_n(PENDING_KEY(ptr), NULL, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns 1 if 'ptr' is freed but not released to its heap yet, else 0.
+ */
+static int ptr_pending(void *ptr) {
+	return __atomic_load_n(PENDING_KEY(ptr), __ATOMIC_RELAXED) == pending_cookie;
+}
+
+/*
+ * Puts validated pointer 'ptr' of heap 'h' on the heap's remote list.
+ * Lock-free, never waits for the heap.
+ */
+static void remote_push(heap *h, void *ptr) {
+	pending_set(ptr);
+	void *head = __atomic_load_n(&h->remote, __ATOMIC_RELAXED);
+	do {
+		*(void**)ptr = head;
+	} while(!__atomic_compare_exchange_n(&h->remote, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Releases everything on the remote list of heap 'h'.
+ * Caller must hold h->lock.
+ */
+static void heap_drain(heap *h) {
+	if(__atomic_load_n(&h->remote, __ATOMIC_RELAXED) == NULL) { return; }
+
+	// Take the whole stack, pushes from now on start a new one
+	void *list = __atomic_exchange_n(&h->remote, NULL, __ATOMIC_ACQUIRE);
+
+	while(list != NULL) {
+		void *next = *(void**)list;
+		pending_clear(list);
+		release_ptr(h, list);
+		list = next;
+	}
+}
+
+/*
+ * Frees validated pointer 'ptr' to the heap it belongs to.
+ * Pointers of the calling thread's heap are released under its lock. So
+ * are pointers of another heap, but only if that heap's lock is free right
+ * now, otherwise they go on its remote list, so a thread never waits for
+ * another heap's lock. Direct blocks need no heap lock at all.
+ */
+static void free_ptr(void *ptr) {
+	heapSegment *seg = find_segment(ptr);
+	if(seg->direct) {
+		direct_free(seg);
+		return;
+	}
+
+	heap *h = seg->owner;
+	if(h == thread_heap()) {
+		pthread_mutex_lock(&h->lock);
+	}
+	else if(pthread_mutex_trylock(&h->lock) != 0) {
+		remote_push(h, ptr);
+		return;
+	}
+
+	heap_drain(h);
+	release_ptr(h, ptr);
+	pthread_mutex_unlock(&h->lock);
+}
+
+/*
+ * Thread-local caches.
+ *
+ * Each thread keeps TC_BINS bins of small blocks and slab slots in front of
+ * its heap, one per usable size a small request can be served with:
+ * the first SLAB_CLASSES bins hold slab slots of each slot size, the rest
+ * hold heap blocks, one bin per block size (8 bytes apart in the compact
+ * format). Every pointer in a bin has at least the bin's usable size.
+ * Cached pointers are still marked in use (blocks in their headers, slots
+ * in their page bitmap), so the heap never coalesces with them. A flushed
+ * pointer of another heap goes to that heap's remote list.
+ *
+ * An empty bin is refilled with TC_FILL blocks under one lock, and a bin
+ * that grows past TC_COUNT is flushed back down to half of that under one
+ * lock, so the common alloc()/free_block() path never touches shared state.
+ * A thread's cache is flushed when the thread exits.
+ */
+#define TC_BINS 32
+#define TC_MAX_SIZE 256
+#define TC_FILL 16
+#define TC_COUNT 64
+
+// Size of the smallest heap block the cache holds, for requests just above the slab sizes
+#define TC_HEAP_FIRST ((SLAB_MAX_SIZE + 1 + HDR_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+typedef struct tcEntry {
+    struct tcEntry *next;
+    void *key; // pending_cookie while cached, see pending_set()
+} tcEntry;
+
+typedef struct tcache {
+    tcEntry *bins[TC_BINS];
+    int counts[TC_BINS];
+    int registered; // thread exit destructor has been set up
+} tcache;
+
+static __thread tcache tc;
+static pthread_key_t tc_key;
+static pthread_once_t tc_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Returns the usable size that a request of 'size' bytes is served with,
+ * a slab slot for small requests, otherwise a heap block without its header.
+ */
+static bsize_t tc_usable(size_t size) {
+	if(size <= SLAB_MAX_SIZE) { return slab_slot_size(size); }
+
+	return block_size(size) - HDR_SIZE;
+}
+
+/*
+ * Returns the bin for a pointer with 'usable' bytes, the bin with the
+ * largest usable size that is not more than 'usable'.
+ */
+static int tc_bin(bsize_t usable) {
+	if(usable < TC_HEAP_FIRST - HDR_SIZE) {
+		int bin = (usable - SLAB_MIN_SLOT) / ALIGNMENT;
+		return bin < SLAB_CLASSES ? bin : SLAB_CLASSES - 1;
+	}
+	return SLAB_CLASSES + (usable + HDR_SIZE - TC_HEAP_FIRST) / ALIGNMENT;
+}
+
+/*
+ * Gives 'count' pointers at the front of bin 'bin' back to the shared heap.
+ */
+static void tc_flush(tcache *cache, int bin, int count) {
+	heap *h = thread_heap();
+
+	pthread_mutex_lock(&h->lock);
+	heap_drain(h);
+	while(count-- > 0 && cache->bins[bin] != NULL) {
+		tcEntry *e = cache->bins[bin];
+		cache->bins[bin] = e->next;
+		cache->counts[bin]--;
+
+		// Still pending on another heap's remote list
+		heap *owner = ptr_heap(e);
+		if(owner == h) {
+			pending_clear(e);
+			release_ptr(h, e);
+		}
+		else { remote_push(owner, e); }
+	}
+	pthread_mutex_unlock(&h->lock);
+}
+
+/*
+ * Thread exit destructor, empties every bin of the exiting thread's cache.
+ */
+static void tc_destroy(void *arg) {
+	tcache *cache = arg;
+	for(int bin = 0; bin < TC_BINS; bin++) {
+		tc_flush(cache, bin, cache->counts[bin]);
+	}
+}
+
+static void tc_make_key(void) {
+	pthread_key_create(&tc_key, tc_destroy);
+}
+
+/*
+ * Refills empty bin 'bin' with pointers of 'usable' bytes and returns one
+ * of them. Slab bins are filled from the slab layer, or from the heap if
+ * no slab page can be made.
+ * Returns NULL if the heap can not provide even one.
+ */
+static void* tc_refill(int bin, bsize_t usable) {
+	if(!tc.registered) {
+		pthread_once(&tc_key_once, tc_make_key);
+		pthread_setspecific(tc_key, &tc);
+		tc.registered = 1;
+	}
+
+	void *ptr = NULL;
+	heap *h = thread_heap();
+
+	pthread_mutex_lock(&h->lock);
+	heap_drain(h);
+	for(int i = 0; i < TC_FILL; i++) {
+		tcEntry *e = NULL;
+		if(bin < SLAB_CLASSES) { e = slab_alloc(h, bin); }
+		if(e == NULL) { e = alloc_block(h, usable); }
+		if(e == NULL) { break; }
+
+		// First one is returned, the rest are cached
+		if(ptr == NULL) {
+			ptr = e;
+			continue;
+		}
+		e->next = tc.bins[bin];
+		pending_set(e);
+		tc.bins[bin] = e;
+		tc.counts[bin]++;
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	return ptr;
+}
+
+
+/*
+ * Puts in use pointer 'ptr' with 'usable' bytes in this thread's cache.
+ * Returns 1 if it was cached, 0 if it is not small enough to cache,
+ * -1 if it is already freed and pending (double free).
+ */
+static int tc_put(void *ptr, bsize_t usable) {
+	int bin = tc_bin(usable);
+	if(bin >= TC_BINS || !tc.registered) { return 0; }
+
+	tcEntry *e = ptr;
+	if(ptr_pending(ptr)) { return -1; }
+
+	pending_set(e);
+	e->next = tc.bins[bin];
+	tc.bins[bin] = e;
+
+	if(++tc.counts[bin] > TC_COUNT) {
+		tc_flush(&tc, bin, TC_COUNT / 2);
+	}
+	return 1;
+}
+
+/*
+ * Allocation tracing, built with -DP3_TRACE.
+ *
+ * Every call of the allocation and free functions appends a
+ * heapTraceRecord (see p3Heap.h) to a ring of TRACE_RING records of the
+ * calling thread, so recording takes no lock. A full ring is written out
+ * to the trace file with a single write(), as is the ring of a thread that
+ * exits, and the one of the main thread at exit() (other threads still
+ * running then have to call heap_trace_flush() themselves).
+ *
+ * The file is $P3_TRACE_FILE, p3heap.trace if that is not set, and is
+ * created at the first record. p3Replay replays it.
+ */
+static bsize_t ptr_usable(void *ptr);
+
+#ifdef P3_TRACE
+#define TRACE_RING 1024
+
+typedef struct traceRing {
+    heapTraceRecord records[TRACE_RING];
+    int count;
+    int muted;              // inside realloc_block(), its alloc() and free_block() are not traced
+    uint16_t thread;        // 0 until the first record
+} traceRing;
+
+static __thread traceRing trace_ring;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static int trace_fd = -1;
+static uint64_t trace_start;
+static uint16_t trace_threads = 0;
+
+static uint64_t trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Writes the records of 'ring' to the trace file and empties it.
+ */
+static void trace_write(traceRing *ring) {
+	char *buf = (char*)ring->records;
+	size_t len = ring->count * sizeof(heapTraceRecord);
+	ring->count = 0;
+
+	while(trace_fd >= 0 && len > 0) {
+		ssize_t done = write(trace_fd, buf, len);
+		if(done <= 0) { break; }
+		buf += done;
+		len -= done;
+	}
+}
+
+static void trace_exit(void *arg) {
+	trace_write(arg);
+}
+
+/*
+ * Creates the trace file, once per process.
+ */
+static void trace_open(void) {
+	const char *path = getenv("P3_TRACE_FILE");
+	if(path == NULL) { path = "p3heap.trace"; }
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(trace_fd >= 0) {
+		heapTraceHeader header = { HEAP_TRACE_MAGIC, HEAP_TRACE_VERSION, sizeof(heapTraceRecord), 0 };
+		if(write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+			close(trace_fd);
+			trace_fd = -1;
+		}
+	}
+
+	trace_start = trace_now();
+	pthread_key_create(&trace_key, trace_exit);
+	atexit(heap_trace_flush);
+}
+
+/*
+ * Records operation 'op' on payload 'addr' (see heapTraceRecord).
+ */
+static void trace_op(int op, void *addr, uint64_t arg, size_t size, size_t block) {
+	traceRing *ring = &trace_ring;
+	if(ring->muted) { return; }
+
+	if(ring->thread == 0) {
+		pthread_once(&trace_once, trace_open);
+		ring->thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+		pthread_setspecific(trace_key, ring);
+	}
+
+	heapTraceRecord *r = &ring->records[ring->count++];
+	r->time = trace_now() - trace_start;
+	r->addr = (uintptr_t)addr;
+	r->arg = arg;
+	r->size = size;
+	r->block = block;
+	r->thread = ring->thread;
+	r->op = op;
+	memset(r->unused, 0, sizeof(r->unused));
+
+	if(ring->count == TRACE_RING) { trace_write(ring); }
+}
+
+#define trace_mute(on) (trace_ring.muted += (on) ? 1 : -1)
+#else
+// Macros rather than empty functions, so the arguments are not evaluated
+#define trace_op(op, addr, arg, size, block) ((void)0)
+#define trace_mute(on) ((void)0)
+#endif
+
+/*
+ * Function for writing the trace records of the calling thread to the
+ * trace file now, in builds with -DP3_TRACE. Does nothing otherwise.
+ */
+void heap_trace_flush(void) {
+#ifdef P3_TRACE
+	if(trace_ring.count > 0) { trace_write(&trace_ring); }
+#endif
+}
+
+/*
+ * Allocates a payload of 'size' bytes for alloc(), see there.
+ * Sets 'clean' like alloc_fit() does, nothing is known zero in blocks
+ * from the thread cache.
+ */
+static void* alloc_ptr(size_t size, char **clean, size_t *clean_len) {
+	*clean_len = 0;
+	if(size < 1 || heap_start == NULL) { return NULL; }
+
+	if(size <= TC_MAX_SIZE) {
+		bsize_t usable = tc_usable(size);
+		int bin = tc_bin(usable);
+
+		if(bin < TC_BINS) {
+			tcEntry *e = tc.bins[bin];
+			if(e == NULL) {
+				void *ptr = tc_refill(bin, usable);
+				if(ptr == NULL) { __atomic_add_fetch(&failed_allocs, 1, __ATOMIC_RELAXED); }
+				return ptr;
+			}
+
+			tc.bins[bin] = e->next;
+			tc.counts[bin]--;
+			pending_clear(e);
+			return e;
+		}
+	}
+
+	heap *h = thread_heap();
+
+	// Large requests get a mapping of their own when one can be had
+	if(size >= direct_min) {
+		void *ptr = direct_alloc(h, size, clean, clean_len);
+		if(ptr != NULL) { return ptr; }
+	}
+
+	pthread_mutex_lock(&h->lock);
+	heap_drain(h);
+	void *ptr = alloc_fit(h, size, clean, clean_len);
+	if(ptr == NULL) { __atomic_add_fetch(&failed_allocs, 1, __ATOMIC_RELAXED); }
+	pthread_mutex_unlock(&h->lock);
+
+	return ptr;
+}
+
+/* 
+ * Function for allocating 'size' bytes of heap memory.
+ * Argument size: requested size for the payload
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ *
+ * Small requests are served from the calling thread's cache, which is
+ * backed by slab slots for the smallest sizes and heap blocks otherwise.
+ * Requests of direct_min bytes and up get a mapping of their own, see
+ * direct_alloc(). Everything else is allocated from the thread's heap by
+ * alloc_block().
+ */
+void* alloc(size_t size) {
+	char *clean;
+	size_t clean_len;
+	void *ptr = alloc_ptr(size, &clean, &clean_len);
+	starts_set(ptr);
+	trace_op(HEAP_TRACE_ALLOC, ptr, 0, size, ptr != NULL ? ptr_usable(ptr) : 0);
+	return ptr;
+}
+
+// Smallest range zero_memory() zeroes with non-temporal stores
+#define NT_ZERO_MIN (1024 * 1024)
+
+/*
+ * Zeroes 'len' bytes at 'p'. Large ranges are written with non-temporal
+ * stores where the CPU has them, so zeroing a big block doesn't evict the
+ * whole cache (the caller is unlikely to read all of it right away).
+ */
+static void zero_memory(char *p, size_t len) {
+#ifdef __SSE2__
+	if(len >= NT_ZERO_MIN) {
+		char *a = (char*)(((uintptr_t)p + 15) & ~(uintptr_t)15);
+		memset(p, 0, a - p);
+		len -= a - p;
+
+		__m128i zero = _mm_setzero_si128();
+		size_t n = len & ~(size_t)63;
+		for(size_t i = 0; i < n; i += 64) {
+			_mm_stream_si128((__m128i*)(a + i), zero);
+			_mm_stream_si128((__m128i*)(a + i + 16), zero);
+			_mm_stream_si128((__m128i*)(a + i + 32), zero);
+			_mm_stream_si128((__m128i*)(a + i + 48), zero);
+		}
+		_mm_sfence();
+		memset(a + n, 0, len - n);
+		return;
+	}
+#endif
+	memset(p, 0, len);
+}
+
+/*
+ * Function for allocating 'size' bytes of zeroed heap memory, like
+ * alloc() followed by a memset(), but cheaper.
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ *
+ * Pages that were never written or were given back to the O.S. are zero
+ * already. The heap knows which those are for large free blocks (the ones
+ * trimming marks released, which includes all fresh memory) and only
+ * zeroes the rest of the block, usually just its first and last page.
+ */
+void* alloc_zeroed(size_t size) {
+	char *clean;
+	size_t clean_len;
+	char *ptr = alloc_ptr(size, &clean, &clean_len);
+
+	if(ptr != NULL) {
+		if(clean_len == 0) {
+			zero_memory(ptr, size);
+		}
+		else {
+			// Zero around the clean pages, as far as the request goes
+			char *end = ptr + size;
+			char *clean_end = clean + clean_len < end ? clean + clean_len : end;
+			zero_memory(ptr, (clean < end ? clean : end) - ptr);
+			if(clean_end < end) { zero_memory(clean_end, end - clean_end); }
+		}
+	}
+
+	starts_set(ptr);
+	trace_op(HEAP_TRACE_ALLOC, ptr, 0, size, ptr != NULL ? ptr_usable(ptr) : 0);
+	return ptr;
+}
+
+/*
+ * Returns the header address inside free block 'b' of 'b_size' bytes at
+ * which a block of 'size' bytes has its payload aligned to 'alignment',
+ * or NULL if no such block fits in 'b'. The part of 'b' in front of the
+ * header is either empty or big enough to be a free block of its own.
+ */
+static char* align_fit(blockHeader *b, bsize_t b_size, bsize_t size, size_t alignment) {
+	char *start = (char*)b;
+	uintptr_t payload = ((uintptr_t)start + HDR_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+	// Leading pad too small for a block, move to the next aligned address
+	while(payload - HDR_SIZE != (uintptr_t)start &&
+			payload - HDR_SIZE - (uintptr_t)start < MIN_BLOCK_SIZE) {
+		payload += alignment;
+	}
+
+	char *header = (char*)(payload - HDR_SIZE);
+	if(header + size > start + b_size) { return NULL; }
+	return header;
+}
+
+/*
+ * Allocates 'request' bytes with the payload aligned to 'alignment'.
+ * Caller must hold h->lock.
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ *
+ * The free lists are searched from the request's class up, then the tree
+ * in size order, for the smallest free block in which an aligned block fits
+ * (same reasoning as find_fit(), blocks in a higher class are always bigger). The found block is split in
+ * up to three: a free leading pad, the aligned block, and a free tail.
+ */
+static void* alloc_aligned_block(heap *h, size_t request, size_t alignment) {
+	bsize_t size = block_size(request);
+	if(size == 0) { return NULL; }
+
+	blockHeader *bestFit = NULL;
+	char *header = NULL;
+
+	for(int pass = 0; pass < 2 && bestFit == NULL; pass++) {
+		// Nothing fits, map enough for the block plus the worst case pad
+		if(pass == 1) {
+			if(alignment > (size_t)BSIZE_MAX - MIN_BLOCK_SIZE ||
+					(size_t)size > (size_t)BSIZE_MAX - MIN_BLOCK_SIZE - alignment) { return NULL; }
+			if(grow_heap(h, size + alignment + MIN_BLOCK_SIZE) != 0) { return NULL; }
+		}
+
+		for(int cls = size_class(size); cls < TREE_CLASS && bestFit == NULL; cls++) {
+			bsize_t bestSize = 0;
+			for(blockHeader *current = h->free_lists[cls]; current != NULL; current = LINKS(current)->next) {
+				bsize_t blockSize = current->size_status & ~STATUS_BITS;
+				if(blockSize < size || (bestFit != NULL && blockSize >= bestSize)) { continue; }
+
+				char *hdr = align_fit(current, blockSize, size, alignment);
+				if(hdr != NULL) {
+					bestFit = current;
+					bestSize = blockSize;
+					header = hdr;
+				}
+			}
+		}
+
+		// Tree blocks in size order, the first one the block fits in is the best
+		blockHeader *current = bestFit == NULL ? tree_ceil(h, size, NULL) : NULL;
+		for(; current != NULL && bestFit == NULL; current = tree_ceil(h, NODE(current)->size, (blockHeader*)((char*)current + 1))) {
+			header = align_fit(current, NODE(current)->size, size, alignment);
+			if(header != NULL) { bestFit = current; }
+		}
+	}
+	if(bestFit == NULL) { return NULL; }
+
+	bsize_t totalFreeSize = bestFit->size_status & ~STATUS_BITS;
+	bsize_t p_bit = bestFit->size_status & P_BIT;
+	int released = is_released(bestFit, totalFreeSize);
+	fl_remove(h, bestFit, totalFreeSize);
+	h->used_blocks++;
+
+	// Leading pad becomes a free block of its own
+	bsize_t pad = header - (char*)bestFit;
+	if(pad > 0) {
+		bestFit->size_status = pad | p_bit;
+		((blockHeader*)(header - HDR_SIZE))->size_status = pad;
+		fl_insert(h, bestFit, pad);
+		if(released) { mark_released(h, bestFit, pad); }
+		p_bit = 0;
+	}
+
+	blockHeader *newBlock = (blockHeader*)header;
+	bsize_t rest = totalFreeSize - pad;
+
+	if(rest - size < MIN_BLOCK_SIZE) {
+		// Use the whole rest, next block's p-bit becomes 1
+		newBlock->size_status = rest | p_bit | A_BIT;
+		HDR_SET_PBIT((blockHeader*)(header + rest));
+	}
+	else {
+		// Free tail after the aligned block
+		newBlock->size_status = size | p_bit | A_BIT;
+
+		blockHeader *tail = (blockHeader*)(header + size);
+		tail->size_status = (rest - size) | P_BIT;
+		((blockHeader*)((char*)tail + rest - size - HDR_SIZE))->size_status = rest - size;
+		fl_insert(h, tail, rest - size);
+		if(released) { mark_released(h, tail, rest - size); }
+	}
+
+	return header + HDR_SIZE;
+}
+
+/*
+ * Function for allocating 'size' bytes of heap memory aligned to
+ * 'alignment' bytes, e.g. for SIMD or cache line sized buffers.
+ * Argument size: requested size for the payload
+ * Argument alignment: requested alignment, a power of 2
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure, or if alignment is not a power of 2.
+ *
+ * Alignments up to ALIGNMENT are what alloc() gives anyway. Larger ones
+ * are carved out of a free block they fit in, the space in front of the
+ * block is split off as a free block instead of being wasted.
+ * The block is freed with free_block() like any other.
+ */
+void* alloc_aligned(size_t size, size_t alignment) {
+	if(size < 1 || heap_start == NULL) { return NULL; }
+	if(alignment == 0 || (alignment & (alignment - 1)) != 0) { return NULL; }
+
+	if(alignment <= ALIGNMENT) { return alloc(size); }
+
+	heap *h = thread_heap();
+
+	pthread_mutex_lock(&h->lock);
+	heap_drain(h);
+	void *ptr = alloc_aligned_block(h, size, alignment);
+	if(ptr == NULL) { __atomic_add_fetch(&failed_allocs, 1, __ATOMIC_RELAXED); }
+	pthread_mutex_unlock(&h->lock);
+
+	starts_set(ptr);
+	trace_op(HEAP_TRACE_ALIGNED, ptr, alignment, size, ptr != NULL ? ptr_usable(ptr) : 0);
+	return ptr;
+}
+
+/*
+ * Carves up to 'count' allocated blocks of 'size' bytes, one after the
+ * other, out of free block 'b' and stores their payloads in 'out'.
+ * Caller must hold h->lock.
+ * Returns the number of blocks carved.
+ *
+ * Whatever is left at the end is split off as a free block, or added to
+ * the last block when it is smaller than MIN_BLOCK_SIZE, as in alloc_block().
+ */
+static size_t carve_blocks(heap *h, blockHeader *b, bsize_t size, size_t count, void **out) {
+	bsize_t totalFreeSize = b->size_status & ~STATUS_BITS;
+	if(count > (size_t)(totalFreeSize / size)) { count = totalFreeSize / size; }
+
+	int released = is_released(b, totalFreeSize);
+	fl_remove(h, b, totalFreeSize);
+	h->used_blocks += count;
+
+	// Only the first block has a free block in front of it
+	bsize_t p_bit = b->size_status & P_BIT;
+	char *header = (char*)b;
+	for(size_t i = 0; i < count; i++) {
+		((blockHeader*)header)->size_status = size | p_bit | A_BIT;
+		out[i] = header + HDR_SIZE;
+		header += size;
+		p_bit = P_BIT;
+	}
+
+	bsize_t rest = totalFreeSize - count * size;
+	if(rest < MIN_BLOCK_SIZE) {
+		// Last block takes the rest, next block's p-bit becomes 1
+		((blockHeader*)(header - size))->size_status += rest;
+		HDR_SET_PBIT((blockHeader*)(header + rest));
+	}
+	else {
+		((blockHeader*)header)->size_status = rest | P_BIT;
+		((blockHeader*)(header + rest - HDR_SIZE))->size_status = rest;
+		fl_insert(h, (blockHeader*)header, rest);
+		if(released) { mark_released(h, (blockHeader*)header, rest); }
+	}
+
+	return count;
+}
+
+/*
+ * Function for allocating 'n' blocks of 'size' bytes at once.
+ * Argument size: requested size for each payload
+ * Argument n: number of blocks
+ * Argument out: array of at least 'n' pointers, filled with the payloads
+ * Returns the number of blocks allocated, which is less than 'n' only if
+ * the heap ran out of memory (0 for invalid arguments).
+ *
+ * The shared heap is locked once for the whole batch. The blocks are
+ * carved back to back out of a single free block that holds all of them
+ * (the heap is grown by one region if there is none), so the best-fit
+ * search is done once rather than once per block. Only if that fails are
+ * smaller free blocks used for the rest.
+ * The blocks are freed with free_block() or free_batch().
+ */
+size_t alloc_batch(size_t size, size_t n, void **out) {
+	if(size < 1 || n < 1 || out == NULL || heap_start == NULL) { return 0; }
+
+	bsize_t bsize = block_size(size);
+	if(bsize == 0) { return 0; }
+
+	size_t done = 0;
+	heap *h = thread_heap();
+
+	pthread_mutex_lock(&h->lock);
+	heap_drain(h);
+	while(done < n) {
+		size_t count = n - done;
+
+		// One free block for all that is left, if the total fits in a block
+		blockHeader *fit = NULL;
+		if(count <= (size_t)(BSIZE_MAX / bsize)) {
+			fit = find_fit(h, bsize * count);
+			if(fit == NULL && grow_heap(h, bsize * count) == 0) {
+				fit = find_fit(h, bsize * count);
+			}
+		}
+
+		// Otherwise as many as fit in the smallest block that holds one
+		if(fit == NULL) { fit = find_fit(h, bsize); }
+		if(fit == NULL && grow_heap(h, bsize) == 0) { fit = find_fit(h, bsize); }
+		if(fit == NULL) { break; }
+
+		done += carve_blocks(h, fit, bsize, count, out + done);
+	}
+	if(done < n) { __atomic_add_fetch(&failed_allocs, 1, __ATOMIC_RELAXED); }
+	pthread_mutex_unlock(&h->lock);
+
+	for(size_t i = 0; i < done; i++) {
+		starts_set(out[i]);
+		trace_op(HEAP_TRACE_ALLOC, out[i], 0, size, ptr_usable(out[i]));
+	}
+	return done;
+}
+
+/*
+ * Checks that 'ptr' is a payload address handed out by alloc() that has
+ * not been freed yet, heap block or slab slot, and sets 'owner' to the
+ * heap it belongs to.
+ * Returns its usable size in bytes, or 0 if 'ptr' is not valid.
+ */
+static bsize_t ptr_check(void *ptr, heap **owner) {
+	// Checks if ptr is NULL or is not a multiple of ALIGNMENT, fails if so
+	if(ptr == NULL || (uintptr_t)ptr % ALIGNMENT != 0) { return 0; }
+
+	// Hardened builds know every payload in use, nothing else gets further
+	if(!starts_test(ptr)) { return 0; }
+
+	// Check if ptr is inside the heap space
+	heapSegment *seg = find_segment(ptr);
+	if(seg == NULL || (char*)ptr < seg->start + ALIGNMENT) { return 0; }
+	*owner = seg->owner;
+
+	bsize_t usable;
+	slabPage *page = slab_find(ptr);
+	if(page != NULL) {
+		// Slab slot, check it is the start of a slot in use
+		if(slab_slot_index(page, ptr) < 0) { return 0; }
+		usable = page->slot_size;
+	}
+	else {
+		// Get ptr's header, then check if its freed already (or in a fast bin)
+		bsize_t status = HDR_LOAD((blockHeader*)((char*)ptr - HDR_SIZE));
+		if((status & A_BIT) == 0 || (status & FAST_BIT) != 0) { return 0; }
+		usable = (status & ~STATUS_BITS) - HDR_SIZE;
+	}
+
+	// Cached and remote pointers are still in use for the heap, but freed already
+	if(ptr_pending(ptr)) { return 0; }
+	return usable;
+}
+
+/*
+ * ptr_check() for callers that don't need the heap.
+ */
+static bsize_t ptr_usable(void *ptr) {
+	heap *owner;
+	return ptr_check(ptr, &owner);
+}
+
+/* 
+ * Function for freeing up a previously allocated block.
+ * Argument ptr: address of the block to be freed up.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ * This function should:
+ * - Return -1 if ptr is NULL.
+ * - Return -1 if ptr is not a multiple of ALIGNMENT.
+ * - Return -1 if ptr is outside of the heap space.
+ * - Return -1 if ptr block is already freed.
+ * - Update header(s) and footer as needed.
+ *
+ * Pointers into a slab span are slab slots, they have no header and are
+ * checked against their page's bitmap instead.
+ * Blocks of a heap_create() heap are freed to that heap.
+ *
+ * If free results in two or more adjacent free blocks,
+ * they will be immediately coalesced into one larger free block.
+ * so free blocks require a footer (blockHeader works) to store the size
+ * Any neighbour that gets coalesced is taken off its free list first,
+ * and the resulting block is put on the list for its new size.
+ *
+ */
+int free_block(void *ptr) {
+	//DONE: Your code goes in here.
+	// !! all work done here was after p3A turn in
+	heap *owner;
+	bsize_t usable = ptr_check(ptr, &owner);
+	if(usable == 0) { return -1; }
+
+	// Hardened builds claim the payload, a racing second free of it fails here
+	if(!starts_clear(ptr)) { return -1; }
+	trace_op(HEAP_TRACE_FREE, ptr, 0, 0, usable);
+
+	// Small blocks go back to this thread's cache without taking the lock,
+	// the cache only holds blocks of the shared heaps
+	if(IS_SHARED(owner)) {
+		int cached = tc_put(ptr, usable);
+		if(cached != 0) { return cached > 0 ? 0 : -1; }
+	}
+
+	free_ptr(ptr);
+	return 0;
+}
+
+/*
+ * Function for freeing a block whose size the caller knows, like
+ * free_block() without the checks.
+ * Argument ptr: address of the block to be freed up.
+ * Argument size: the size it was allocated with, or anything from 1 up
+ *   to its block_usable_size(). Anything bigger corrupts the heap.
+ * Only for blocks of alloc() and friends, not of heap_alloc().
+ * Returns 0 on success.
+ * Returns -1 if ptr is NULL (or, in hardened builds, not in use).
+ *
+ * Small blocks are put in the thread cache without finding the block's
+ * segment. The bin is the one for the usable size of the slot or block
+ * itself, not for 'size': small requests are also served by heap blocks
+ * (alloc_batch(), alloc_aligned(), a realloc_block() shrink), which hold
+ * fewer bytes than a slot for the same size. Larger ones are freed like
+ * free_block() does, only the validation is skipped.
+ */
+int free_block_sized(void *ptr, size_t size) {
+	if(ptr == NULL || size < 1) { return -1; }
+
+	// The bitmap check is cheap, hardened builds keep it
+	if(!starts_clear(ptr)) { return -1; }
+	trace_op(HEAP_TRACE_FREE, ptr, 0, 0, 0);
+
+	if(size <= TC_MAX_SIZE) {
+		slabPage *page = slab_find(ptr);
+		bsize_t usable = page != NULL ? (bsize_t)__atomic_load_n(&page->slot_size, __ATOMIC_RELAXED) :
+				(HDR_LOAD((blockHeader*)((char*)ptr - HDR_SIZE)) & ~STATUS_BITS) - HDR_SIZE;
+		int cached = tc_put(ptr, usable);
+		if(cached != 0) { return cached > 0 ? 0 : -1; }
+	}
+
+	free_ptr(ptr);
+	return 0;
+}
+
+/*
+ * Function for getting the usable size of an allocated block.
+ * Argument ptr: address of the block.
+ * Returns the number of bytes the caller may use at ptr, at least the
+ * size it was allocated with (alignment and size classes often add a few
+ * more). Returns 0 if ptr is not an allocated block.
+ *
+ * The whole usable size can be used without calling realloc_block().
+ */
+size_t block_usable_size(void *ptr) {
+	return ptr_usable(ptr);
+}
+
+static int ptr_cmp(const void *a, const void *b) {
+	uintptr_t x = (uintptr_t)*(void* const*)a;
+	uintptr_t y = (uintptr_t)*(void* const*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Function for freeing 'n' previously allocated blocks at once.
+ * Argument ptrs: the payload addresses, the array is sorted in place
+ * Argument n: number of pointers
+ * Returns 0 on success.
+ * Returns -1 if any pointer is invalid or appears twice,
+ * nothing is freed in that case.
+ *
+ * Every pointer is checked as in free_block() before anything is freed.
+ * The pointers are sorted by address, so runs of heap blocks that are next
+ * to each other are joined into one block and freed (and coalesced with
+ * their neighbours) once, under a single lock per heap the pointers belong
+ * to. Batches bypass the thread cache and the remote lists.
+ */
+int free_batch(void **ptrs, size_t n) {
+	if(ptrs == NULL) { return -1; }
+
+	qsort(ptrs, n, sizeof(void*), ptr_cmp);
+
+	for(size_t i = 0; i < n; i++) {
+		bsize_t usable = ptr_usable(ptrs[i]);
+		if(usable == 0 || (i > 0 && ptrs[i] == ptrs[i - 1]) || !starts_clear(ptrs[i])) {
+			// Nothing is freed, the payloads claimed so far stay in use
+			while(i-- > 0) { starts_set(ptrs[i]); }
+			return -1;
+		}
+	}
+	for(size_t i = 0; i < n; i++) { trace_op(HEAP_TRACE_FREE, ptrs[i], 0, 0, 0); }
+
+	heap *h = NULL;
+	for(size_t i = 0; i < n; ) {
+		heapSegment *seg = find_segment(ptrs[i]);
+		if(seg->direct) {
+			direct_free(seg);
+			i++;
+			continue;
+		}
+
+		// Sorted pointers of one heap mostly come one after the other
+		heap *owner = seg->owner;
+		if(owner != h) {
+			if(h != NULL) { pthread_mutex_unlock(&h->lock); }
+			h = owner;
+			pthread_mutex_lock(&h->lock);
+			heap_drain(h);
+		}
+
+		slabPage *page = slab_find(ptrs[i]);
+		if(page != NULL) {
+			slab_free(h, page, slab_slot_index(page, ptrs[i]));
+			i++;
+			continue;
+		}
+
+		// Join the following blocks that start right where this one ends,
+		// their headers become part of the joined block. A slab slot can
+		// start there too (the first slot of a span with out of band page
+		// headers), it ends the run and is freed as a slot
+		blockHeader *run = (blockHeader*)((char*)ptrs[i] - HDR_SIZE);
+		char *end = (char*)run + (run->size_status & ~STATUS_BITS);
+		for(i++; i < n && (char*)ptrs[i] - HDR_SIZE == end && slab_find(ptrs[i]) == NULL; i++) {
+			bsize_t size = ((blockHeader*)end)->size_status & ~STATUS_BITS;
+			run->size_status += size;
+			end += size;
+			h->used_blocks--;
+		}
+		release_block(h, run);
+	}
+	if(h != NULL) { pthread_mutex_unlock(&h->lock); }
+
+	return 0;
+}
+
+
+/*
+ * Resizes allocated block 'ptr_header' to hold 'request' bytes without
+ * copying its payload.
+ * Caller must hold h->lock.
+ * Returns the block's header, which only changes when the block was moved
+ * with mremap, or NULL if it can't be resized without copying.
+ *
+ * - Shrinking splits the tail off as a free block, when it is big enough
+ *   to be one, which is coalesced with the next block if that is free.
+ * - Growing takes the next block if it is free and big enough, the rest
+ *   of it is split off again. Same p-bit/a-bit and footer rules as
+ *   free_block() and alloc().
+ * - A large last block of a segment first grows the segment under it
+ *   with mremap, so the space after it becomes a free next block. If it
+ *   is the only block in its segment the whole segment may be moved.
+ */
+static blockHeader* resize_block(heap *h, blockHeader *ptr_header, size_t request) {
+	bsize_t size = block_size(request);
+	if(size == 0) { return NULL; }
+
+	bsize_t cur_size = ptr_header->size_status & ~STATUS_BITS;
+	blockHeader *next_header = (blockHeader*)((char*)ptr_header + cur_size);
+
+	if(size > cur_size) {
+		// Free space right after the block
+		bsize_t next_size = 0;
+		if((next_header->size_status & A_BIT) == 0) {
+			next_size = next_header->size_status & ~STATUS_BITS;
+		}
+
+		// A large block at the end of its segment (maybe followed by one free
+		// block) grows the segment, the new space coalesces into the next block
+		blockHeader *after = (blockHeader*)((char*)next_header + next_size);
+		if(cur_size + next_size < size && cur_size >= MREMAP_MIN &&
+				(after->size_status & ~STATUS_BITS) == 0 && IS_SHARED(h)) {
+			heapSegment *seg = find_segment(ptr_header);
+			char *old_start = seg->start;
+			// heap_start never moves
+			int alone = seg != &segments[0] && (char*)ptr_header == seg->start + SEG_PAD;
+
+			if(seg_remap(h, seg, size - cur_size - next_size, alone) == 0) {
+				ptr_header = (blockHeader*)(seg->start + ((char*)ptr_header - old_start));
+				next_header = (blockHeader*)((char*)ptr_header + cur_size);
+				next_size = next_header->size_status & ~STATUS_BITS;
+			}
+		}
+
+		// Next block has to be free and big enough to grow into
+		if(next_size == 0 || cur_size + next_size < size) {
+			return NULL;
+		}
+
+		// Take all of the next block, its p-bit neighbour is now after ptr
+		fl_remove(h, next_header, next_size);
+		cur_size += next_size;
+		ptr_header->size_status = cur_size | (ptr_header->size_status & STATUS_BITS);
+
+		next_header = (blockHeader*)((char*)ptr_header + cur_size);
+		HDR_SET_PBIT(next_header);
+	}
+
+	// Split off what is left over, it is freed like any other block
+	if(cur_size - size >= MIN_BLOCK_SIZE) {
+		ptr_header->size_status = size | (ptr_header->size_status & STATUS_BITS);
+
+		blockHeader *tail = (blockHeader*)((char*)ptr_header + size);
+		tail->size_status = (cur_size - size) | P_BIT | A_BIT;
+		h->used_blocks++;
+		release_block(h, tail);
+	}
+
+	return ptr_header;
+}
+
+/*
+ * Function for resizing a previously allocated block.
+ * Argument ptr: address of the block to be resized, or NULL.
+ * Argument size: new requested size for the payload.
+ * Returns address of the resized block's payload on success, which is
+ * ptr itself whenever the block could be resized in place (large blocks
+ * may also be moved by mremap without copying).
+ * Returns NULL on failure, ptr is left allocated and untouched.
+ *
+ * - If ptr is NULL, this is alloc(size).
+ * - If size is 0, this is free_block(ptr) and NULL is returned.
+ * - Heap blocks grow and shrink in place when possible, see resize_block().
+ * - Slab slots stay where they are as long as the new size fits the slot.
+ * - Direct blocks are remapped, see direct_resize().
+ * - Otherwise the payload is copied to a new block as a last resort.
+ * Also resizes blocks of heap_create() heaps, within their heap.
+ */
+void* realloc_block(void *ptr, size_t size) {
+	if(ptr == NULL) { return alloc(size); }
+
+	bsize_t usable = ptr_usable(ptr);
+	if(usable == 0) { return NULL; }
+
+	if(size == 0) {
+		free_block(ptr);
+		return NULL;
+	}
+
+	heapSegment *seg = find_segment(ptr);
+	heap *h = seg->owner;
+	void *new_ptr = NULL;
+	if(seg->direct) {
+		// Remapped, unless it is small enough for the heap now
+		new_ptr = direct_resize(seg, size);
+	}
+	else if(slab_find(ptr) == NULL) {
+		// Resized in the heap the block belongs to
+		pthread_mutex_lock(&h->lock);
+		blockHeader *resized = resize_block(h, (blockHeader*)((char*)ptr - HDR_SIZE), size);
+		pthread_mutex_unlock(&h->lock);
+
+		if(resized != NULL) { new_ptr = (char*)resized + HDR_SIZE; }
+	}
+	else if(size <= (size_t)usable) {
+		trace_op(HEAP_TRACE_REALLOC, ptr, (uintptr_t)ptr, size, usable);
+		return ptr;
+	}
+
+	if(new_ptr != NULL) {
+		// mremap may have moved it
+		if(new_ptr != ptr) {
+			starts_clear(ptr);
+			starts_set(new_ptr);
+		}
+		trace_op(HEAP_TRACE_REALLOC, new_ptr, (uintptr_t)ptr, size, ptr_usable(new_ptr));
+		return new_ptr;
+	}
+
+	// Move it (within its heap_create() heap, if it has one), traced as one realloc
+	trace_mute(1);
+	new_ptr = IS_SHARED(h) ? alloc(size) : heap_alloc(h, size);
+	if(new_ptr != NULL) {
+		memcpy(new_ptr, ptr, (size_t)usable < size ? (size_t)usable : size);
+		free_block(ptr);
+	}
+	trace_mute(0);
+
+	trace_op(HEAP_TRACE_REALLOC, new_ptr, (uintptr_t)ptr, size, new_ptr != NULL ? ptr_usable(new_ptr) : 0);
+	return new_ptr;
+}
+
+/*
+ * Separate heaps.
+ *
+ * heap_create() maps a heap of its own, e.g. for each tenant, so tenants
+ * don't fragment each other or the shared heaps. It is a single mapping
+ * of a fixed size that never grows: the heap struct at its start, then
+ * one segment laid out like any other. So heap_destroy() gives all of it
+ * back with one munmap(), however many blocks are still allocated.
+ *
+ * Its blocks bypass the thread caches and the slab layer and are not
+ * traced, but are otherwise blocks like any other: free_block(),
+ * realloc_block() and block_usable_size() work on them too. The page
+ * options and placement policy are the ones init_heap_flags() was given.
+ */
+#define HEAP_T_SIZE ((sizeof(heap) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+/*
+ * Function for making a separate heap, see above.
+ * Argument size: bytes the heap can hold, headers and padding included.
+ * Returns the new heap.
+ * Returns NULL if size is 0 or too large, or the O.S. is out of memory.
+ */
+heap_t* heap_create(size_t size) {
+	if(size == 0 || heap_start == NULL) { return NULL; }
+
+	// Heap struct, pad and end mark, in whole pages
+	size_t pagesize = map_page;
+	if(size > BSIZE_MAX - HEAP_T_SIZE - ALIGNMENT - pagesize) { return NULL; }
+	size_t len = (size + HEAP_T_SIZE + ALIGNMENT + pagesize - 1) / pagesize * pagesize;
+
+	heap init = { .node = current_node() };
+	char *mmap_ptr = map_memory(&init, NULL, len);
+	if(MAP_FAILED == mmap_ptr) { return NULL; }
+
+	// Fresh pages are zero, so are all the lists and counters
+	heap *h = (heap*)mmap_ptr;
+	pthread_mutex_init(&h->lock, NULL);
+	h->id = -1;
+	h->node = init.node;
+
+	h->last_seg = seg_claim(mmap_ptr + HEAP_T_SIZE, len - HEAP_T_SIZE, h);
+	if(h->last_seg < 0) {
+		munmap(mmap_ptr, len);
+		return NULL;
+	}
+	heapSegment *seg = &segments[h->last_seg];
+
+	// One big free block, freed like the new space of grow_heap()
+	blockHeader *first = (blockHeader*)(seg->start + SEG_PAD);
+	first->size_status = (len - HEAP_T_SIZE - ALIGNMENT) | P_BIT | A_BIT;
+	SEG_END_MARK(seg)->size_status = P_BIT | A_BIT;
+
+	h->used_blocks++;
+	release_block(h, first);
+	return h;
+}
+
+/*
+ * Function for allocating 'size' bytes from heap 'h', like alloc() does
+ * from the shared heaps (which is what a NULL 'h' does).
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure, also when the heap is full.
+ */
+void* heap_alloc(heap_t *h, size_t size) {
+	if(h == NULL) { return alloc(size); }
+
+	pthread_mutex_lock(&h->lock);
+	heap_drain(h);
+	void *ptr = alloc_block(h, size);
+	pthread_mutex_unlock(&h->lock);
+
+	starts_set(ptr);
+	return ptr;
+}
+
+/*
+ * Function for freeing a block of heap 'h', like free_block() (which is
+ * what a NULL 'h' does).
+ * Returns 0 on success.
+ * Returns -1 if ptr is not an allocated block of 'h'.
+ */
+int heap_free(heap_t *h, void *ptr) {
+	if(h == NULL) { return free_block(ptr); }
+
+	heap *owner;
+	if(ptr_check(ptr, &owner) == 0 || owner != h) { return -1; }
+	if(!starts_clear(ptr)) { return -1; }
+
+	pthread_mutex_lock(&h->lock);
+	heap_drain(h);
+	release_ptr(h, ptr);
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
+
+/*
+ * Function for giving all memory of heap 'h' back to the O.S. at once.
+ * Every block of the heap is freed, no other thread may still use any.
+ * A heap_open() heap is only unmapped, its file keeps the blocks for the
+ * next heap_open().
+ */
+void heap_destroy(heap_t *h) {
+	if(h == NULL) { return; }
+
+	heapSegment *seg = &segments[h->last_seg];
+	char *start = h->file != NULL ? (char*)h->file : (char*)h;
+	size_t len = seg->start + seg->len - start;
+	int fd = h->file != NULL ? h->fd : -1;
+
+	// The entry stops matching before the memory goes away
+	pthread_mutex_lock(&heaps_lock);
+	seg_set(seg, seg->start, 0);
+	seg->owner = NULL;
+	pthread_mutex_unlock(&heaps_lock);
+
+	starts_unmap(start, len);
+	munmap(start, len);
+	if(fd >= 0) { close(fd); }
+}
+
+/*
+ * Persistent heaps.
+ *
+ * heap_open() is heap_create() backed by a file mapped with MAP_SHARED,
+ * so the blocks and their contents outlive the process: a restarted
+ * process opens the same file and finds every block it had allocated,
+ * without rebuilding its data. A file under /dev/shm survives restarts
+ * but not reboots and never touches a disk.
+ *
+ * The file is a heapFile header, the heap struct, then the heap's single
+ * segment. The file may be mapped at another address on the next open, so
+ * nothing in it that holds an address is trusted: the free lists, the
+ * tree and the fast bins are rebuilt from the chain of block headers,
+ * which only holds sizes and status bits, after heap_open() has checked
+ * the chain like heap_check() does. A file whose chain is broken (a
+ * process died in the middle of alloc() or free_block()) is not opened.
+ * The one address the heap keeps for the caller, its root block, is
+ * stored as an offset. Pointers the caller keeps inside blocks should be
+ * offsets too, e.g. from heap_root().
+ *
+ * Only one process can have the file open at a time, it is locked with
+ * flock() while it is mapped.
+ */
+#define HEAP_FILE_MAGIC 0x50334850u  // "PH3P"
+#define HEAP_FILE_VERSION 1
+
+typedef struct heapFile {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hdr_size;      // HDR_SIZE, ALIGNMENT and HEAP_T_SIZE of the build that made it
+    uint32_t alignment;
+    uint64_t heap_t_size;
+    uint64_t len;           // length of the file
+    uint64_t root;          // offset of the root block's payload, 0 if none
+} heapFile;
+
+#define HEAP_FILE_SIZE ((sizeof(heapFile) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+static int check_segment(heapSegment *seg, size_t *free_blocks, size_t *free_bytes, size_t *fast, void **where);
+
+/*
+ * Rebuilds the free lists and tree of heap_open() heap 'h' from the
+ * blocks of its segment 'seg', once they have been checked.
+ * Caller must have reset everything else in 'h'.
+ * Argument root: the root block's payload, NULL if there is none.
+ * Returns 0, or the HEAP_CHECK_* code of the first broken invariant, or
+ * -1 if 'root' is not an allocated block.
+ */
+static int file_rebuild(heap *h, heapSegment *seg, char *root) {
+	size_t free_blocks = 0, free_bytes = 0, fast = 0;
+	void *where;
+	int ret = check_segment(seg, &free_blocks, &free_bytes, &fast, &where);
+	if(ret != 0) { return ret; }
+
+	char *end = (char*)SEG_END_MARK(seg);
+	blockHeader *first = (blockHeader*)(seg->start + SEG_PAD);
+	int root_found = root == NULL;
+	for(blockHeader *b = first; (char*)b < end; ) {
+		bsize_t size = b->size_status & ~(bsize_t)(ALIGNMENT - 1);
+		if((b->size_status & A_BIT) == 0) {
+			fl_insert(h, b, size);
+		}
+		else {
+			h->used_blocks++;
+			if((b->size_status & FAST_BIT) == 0) {
+				starts_set((char*)b + HDR_SIZE);
+				if((char*)b + HDR_SIZE == root) { root_found = 1; }
+			}
+		}
+		b = (blockHeader*)((char*)b + size);
+	}
+	if(!root_found) { return -1; }
+
+	// Blocks that were in a fast bin are freed for real, the walk steps
+	// over a next block they coalesce with
+	for(blockHeader *b = first; fast > 0 && (char*)b < end; ) {
+		bsize_t size = b->size_status & ~(bsize_t)(ALIGNMENT - 1);
+		blockHeader *next = (blockHeader*)((char*)b + size);
+		if(b->size_status & FAST_BIT) {
+			b->size_status &= ~FAST_BIT;
+			if((next->size_status & A_BIT) == 0) {
+				next = (blockHeader*)((char*)next + (next->size_status & ~STATUS_BITS));
+			}
+			release_block(h, b);
+		}
+		b = next;
+	}
+	return 0;
+}
+
+/*
+ * Unmaps heap file mapping 'start' of 'len' bytes and closes its file 'fd'.
+ */
+static void file_unmap(char *start, size_t len, int fd) {
+	starts_unmap(start, len);
+	munmap(start, len);
+	close(fd);
+}
+
+/*
+ * Function for opening a persistent heap, see above.
+ * Argument path: the heap's file, made if it doesn't exist or is empty.
+ * Argument size: bytes a new heap can hold, as for heap_create(), the
+ *   size of an existing heap stays what it was.
+ * Returns the heap, with every block that was allocated when the file was
+ * last used still allocated.
+ * Returns NULL if the file can't be opened, mapped or locked, or isn't a
+ * heap file of this build, or its blocks are broken (their headers are
+ * left as they were then).
+ * Blocks of a heap_open() heap are used like those of heap_create(),
+ * heap_destroy() unmaps the heap and closes the file.
+ */
+heap_t* heap_open(const char *path, size_t size) {
+	if(path == NULL || heap_start == NULL) { return NULL; }
 
-	// Add header bytes to size
-	size += 4;
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	if(fd < 0) { return NULL; }
 
-	// Add padding if needed to make total block size (w/ header) a multiple of 8
-	if(size % 8 != 0) {
-		size = size + (8 - (size % 8));
+	struct stat st;
+	if(flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
 	}
 
-	// Init search values (current block and best fit/size so far)
-	// that will be used in the best fit search
-	blockHeader *current = heap_start;
-	blockHeader *bestFit = NULL;
-	int bestSize = INT_MAX;
-	heap_end = (char*)heap_start + alloc_size;
-
-	// Best-Fit search, repeat until at end of heap
-	while((char*)current < heap_end && current->size_status != 1) {
-		// Store raw size of the current block for usage later
-		int blockSize = current->size_status & ~0x3;
-		// Store next block header for usage later
-		blockHeader* nextHeader = (blockHeader*)((char*)current + blockSize);
-
-		// If the current block being searched isnt big enough, continue search
-		if(blockSize < size) {
-			current = nextHeader;
-			continue;
+	// A new file gets the header, heap struct, pad and end mark, in whole pages
+	size_t pagesize = getpagesize();
+	int made = st.st_size == 0;
+	size_t len = st.st_size;
+	if(made) {
+		if(size == 0 || size > BSIZE_MAX - HEAP_FILE_SIZE - HEAP_T_SIZE - ALIGNMENT - pagesize) {
+			close(fd);
+			return NULL;
 		}
-
-		// Only perform size checks on free blocks
-		if((current->size_status & 0x1) == 0) {
-			// If current search block matches size exactly, use it (just update its header)
-			// otherwise search through heap normally
-			if(blockSize == size) {
-				current->size_status += 1; // set a-bit to 1
-
-				// If next header's pbit is 0, make it 1, dont change if its the end of heap
-				if((char*)nextHeader < heap_end && (nextHeader->size_status & 0x2) == 0) {
-					nextHeader->size_status += 2;
-				}
-				// Return the updated block header's payload address
-				return (void*)((char*)current + 4);
-			}
-			else {
-				// Find lowest size free block that fits size
-				if(blockSize >= size && blockSize < bestSize) {
-					bestSize = blockSize;
-					bestFit = current;
-				}
-			}
+		len = (size + HEAP_FILE_SIZE + HEAP_T_SIZE + ALIGNMENT + pagesize - 1) / pagesize * pagesize;
+		if(ftruncate(fd, len) != 0) {
+			close(fd);
+			return NULL;
 		}
-		// Iterate to next block
-		current = nextHeader;
+	}
+	if(len < HEAP_FILE_SIZE + HEAP_T_SIZE + ALIGNMENT + MIN_BLOCK_SIZE || len > (size_t)BSIZE_MAX) {
+		close(fd);
+		return NULL;
 	}
 
-	// Split bestFit block if one was found
-	// newBlock will be the inserted block
-	// bestFit will be updated to be the free block
-	if(bestFit != NULL) {
-		// Store size of block we split, and new bestFit size after split
-		int totalFreeSize = bestFit->size_status & ~0x3;
-		int bestFitSize = totalFreeSize - size;
+	char *mmap_ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(MAP_FAILED == mmap_ptr) {
+		close(fd);
+		return NULL;
+	}
+
+	heapFile *file = (heapFile*)mmap_ptr;
+	if(made) {
+		file->magic = HEAP_FILE_MAGIC;
+		file->version = HEAP_FILE_VERSION;
+		file->hdr_size = HDR_SIZE;
+		file->alignment = ALIGNMENT;
+		file->heap_t_size = HEAP_T_SIZE;
+		file->len = len;
+		file->root = 0;
+	}
+	if(file->magic != HEAP_FILE_MAGIC || file->version != HEAP_FILE_VERSION || file->hdr_size != HDR_SIZE ||
+			file->alignment != ALIGNMENT || file->heap_t_size != HEAP_T_SIZE || file->len != len ||
+			starts_map(mmap_ptr, len) != 0) {
+		file_unmap(mmap_ptr, len, fd);
+		return NULL;
+	}
 
-		// Create new block of memory (keep p-bit same, a-bit is 1)
-		blockHeader* newBlock = bestFit;
-		newBlock->size_status = size + (bestFit->size_status & 0x2) + 1;
+	// Whatever the heap struct held points into the old mapping
+	heap *h = (heap*)(mmap_ptr + HEAP_FILE_SIZE);
+	memset(h, 0, sizeof(heap));
+	pthread_mutex_init(&h->lock, NULL);
+	h->id = -1;
+	h->node = -1;
+	h->file = file;
+	h->fd = fd;
 
-		// Update bestFit's payload addr
-		bestFit = (blockHeader*)((char*)newBlock + size);
-		// Update bestFit's footer size
-		((blockHeader*)((char*)bestFit + bestFitSize - 4))->size_status = bestFitSize;
-		// Update bestFit's header value
-		// !! updated since p3A turn in, just better logic instead of adding 2
-		bestFit->size_status = bestFitSize | (newBlock->size_status & 0x2);
+	// The segment isn't in the table yet, so nothing else sees it
+	heapSegment seg = { mmap_ptr + HEAP_FILE_SIZE + HEAP_T_SIZE, len - HEAP_FILE_SIZE - HEAP_T_SIZE, h, 0 };
+	if(made) {
+		// One big free block, the new file reads as zero
+		blockHeader *first = (blockHeader*)(seg.start + SEG_PAD);
+		first->size_status = (seg.len - ALIGNMENT) | P_BIT | A_BIT;
+		SEG_END_MARK(&seg)->size_status = P_BIT | A_BIT;
+		h->used_blocks++;
+		release_block(h, first);
+	}
+	else if(file->root >= len || file_rebuild(h, &seg, file->root != 0 ? mmap_ptr + file->root : NULL) != 0) {
+		file_unmap(mmap_ptr, len, fd);
+		return NULL;
+	}
 
-		// Return payload addr of newBlock
-		return (void*)((char*)newBlock + 4);
+	h->last_seg = seg_claim(seg.start, seg.len, h);
+	if(h->last_seg < 0) {
+		file_unmap(mmap_ptr, len, fd);
+		return NULL;
 	}
+	return h;
+}
 
-	return NULL;
+/*
+ * Function for getting the root block of heap_open() heap 'h', the block
+ * heap_set_root() was last given, from which the caller finds the rest of
+ * its data after a restart.
+ * Returns its payload address, or NULL if there is none (or 'h' isn't a
+ * heap_open() heap).
+ */
+void* heap_root(heap_t *h) {
+	if(h == NULL || h->file == NULL || h->file->root == 0) { return NULL; }
+	return (char*)h->file + h->file->root;
 }
 
-/* 
- * Function for freeing up a previously allocated block.
- * Argument ptr: address of the block to be freed up.
+/*
+ * Function for setting the root block of heap_open() heap 'h' to 'ptr',
+ * a block of 'h', or NULL for none.
  * Returns 0 on success.
- * Returns -1 on failure.
- * This function should:
- * - Return -1 if ptr is NULL.
- * - Return -1 if ptr is not a multiple of 8.
- * - Return -1 if ptr is outside of the heap space.
- * - Return -1 if ptr block is already freed.
- * - Update header(s) and footer as needed.
+ * Returns -1 if 'h' isn't a heap_open() heap or 'ptr' isn't one of its
+ * allocated blocks.
+ */
+int heap_set_root(heap_t *h, void *ptr) {
+	if(h == NULL || h->file == NULL) { return -1; }
+
+	heap *owner;
+	if(ptr != NULL && (ptr_check(ptr, &owner) == 0 || owner != h)) { return -1; }
+
+	h->file->root = ptr != NULL ? (uint64_t)((char*)ptr - (char*)h->file) : 0;
+	return 0;
+}
+
+/*
+ * Arenas.
  *
- * If free results in two or more adjacent free blocks,
- * they will be immediately coalesced into one larger free block.
- * so free blocks require a footer (blockHeader works) to store the size
+ * An arena hands out memory with a bump pointer inside large blocks it
+ * takes from alloc(), and arena_reset() takes all of it back at once, e.g.
+ * at the end of a request. Its allocations have no headers or footers
+ * and are never freed one by one.
  *
+ * The arena struct is at the start of its first block. When a request
+ * doesn't fit in what is left of the current block, the arena allocates
+ * another one (at least as large as the first) and links it to the
+ * chunks list. arena_reset() frees every block but the first, so an
+ * arena that is reused for similar requests settles on one block.
+ * An arena is not locked, only one thread at a time may use it.
  */
-int free_block(void *ptr) {
-	//DONE: Your code goes in here.
-	// !! all work done here was after p3A turn in
-	// Checks if ptr is NULL or is not a multiple of 8, fails if so
-	if(ptr == NULL || (uintptr_t)ptr % 8 != 0) { return -1; }
+typedef struct arenaChunk {
+    struct arenaChunk *next;
+} arenaChunk;
 
-	// Init heap_end (as char*) and then
-	// Check if ptr is inside the heap space
-	heap_end = (char*)heap_start + alloc_size;
-	if((char*)ptr < (char*)heap_start || (char*)ptr >= heap_end) { return -1; }
+struct arena {
+    char *next;             // where the next allocation starts
+    char *end;              // end of the current block
+    arenaChunk *chunks;     // blocks after the first, newest first
+    size_t size;            // usable size of the first block
+};
 
-	// Get ptr's header for later use, then check if its freed already
-	blockHeader* ptr_header = (blockHeader*)((char*)ptr - 4);
-	if((ptr_header->size_status & 0x1) == 0) { return -1; }
+#define ARENA_SIZE ((sizeof(arena_t) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+#define CHUNK_SIZE ((sizeof(arenaChunk) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
 
-	// Set ptr_header a-bit to 0/free
-	ptr_header->size_status = ptr_header->size_status & ~0x1;
+/*
+ * Function for making an arena, see above.
+ * Argument size: bytes the arena holds before it needs a second block.
+ * Returns the new arena.
+ * Returns NULL if the heap is out of memory.
+ */
+arena_t* arena_create(size_t size) {
+	if(size > SIZE_MAX - ARENA_SIZE) { return NULL; }
 
-	// Init size of ptr for later use
-	int ptr_size = ptr_header->size_status & ~0x3;
+	arena_t *a = alloc(ARENA_SIZE + size);
+	if(a == NULL) { return NULL; }
 
-	// Init next_header to point to next block's header
-	blockHeader* next_header = (blockHeader*)((char*)ptr_header + ptr_size);
+	a->size = block_usable_size(a);
+	a->next = (char*)a + ARENA_SIZE;
+	a->end = (char*)a + a->size;
+	a->chunks = NULL;
+	return a;
+}
 
-	// If the next block is free, coalesce it into ptr
-	if((next_header->size_status & 0x1) == 0) {
-		// Add next block's size to ptr
-		int next_size = (next_header->size_status & ~0x3);
-		ptr_size += next_size;
-		ptr_header->size_status = ptr_size | (ptr_header->size_status & 0x2);
-	}
+/*
+ * Function for allocating 'size' bytes from arena 'a'.
+ * Returns address of the allocation, aligned like alloc() does it.
+ * Returns NULL if size is 0 or the heap is out of memory.
+ * The memory stays allocated until arena_reset() or arena_destroy(), it
+ * must not be passed to free_block() or realloc_block().
+ */
+void* arena_alloc(arena_t *a, size_t size) {
+	if(size < 1 || size > SIZE_MAX - ALIGNMENT) { return NULL; }
+	size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
 
-	// Check if previous block is free, if so
-	// we will coalesce it into ptr
-	if((ptr_header->size_status & 0x2) == 0) {
-		// Get footer of previous block
-		blockHeader* prev_footer = (blockHeader*)((char*)ptr_header - 4);
-		// Init prev_header to point to previous block's header
-		blockHeader* prev_header = (blockHeader*)((char*)ptr_header - prev_footer->size_status);
+	if(size > (size_t)(a->end - a->next)) {
+		// Doesn't fit, start a new block
+		size_t chunk = size > a->size ? size : a->size;
+		if(chunk > SIZE_MAX - CHUNK_SIZE) { return NULL; }
 
-		// Update ptr_header to be where prev_header is
-		ptr_header = prev_header;
+		arenaChunk *c = alloc(CHUNK_SIZE + chunk);
+		if(c == NULL) { return NULL; }
+		c->next = a->chunks;
+		a->chunks = c;
+		a->next = (char*)c + CHUNK_SIZE;
+		a->end = (char*)c + block_usable_size(c);
+	}
 
-		// Update ptr's size to ptr + size of previous block
-		ptr_size += prev_footer->size_status;
-		ptr_header->size_status = ptr_size | (prev_header->size_status & 0x2);
+	void *ptr = a->next;
+	a->next += size;
+	return ptr;
+}
 
-		// Update payload address of ptr
-		ptr = (char*)ptr_header + 4;
+/*
+ * Gives back everything allocated from arena 'a' at once, with one
+ * free_block() for each block the arena took after its first.
+ */
+void arena_reset(arena_t *a) {
+	while(a->chunks != NULL) {
+		arenaChunk *c = a->chunks;
+		a->chunks = c->next;
+		free_block(c);
 	}
+	a->next = (char*)a + ARENA_SIZE;
+	a->end = (char*)a + a->size;
+}
 
-	// Now that all coalescing is done, properly set p-bit of next_header
-	next_header = (blockHeader*)((char*)ptr_header + ptr_size);
-	if((next_header->size_status & ~0x3) != 0) {
-		next_header->size_status = (next_header->size_status & ~0x2);
+/*
+ * Frees arena 'a' and everything allocated from it.
+ */
+void arena_destroy(arena_t *a) {
+	if(a == NULL) { return; }
+	arena_reset(a);
+	free_block(a);
+}
+
+/*
+ * Returns the default huge page size of the system, 2 MiB if unknown.
+ */
+static size_t huge_page_size(void) {
+    size_t size = 2 * 1024 * 1024;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL) return size;
+
+    char line[128];
+    size_t kb;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1) {
+            size = kb * 1024;
+            break;
+        }
+    }
+    fclose(f);
+    return size;
+}
+
+/*
+ * fork() handlers, registered by init_heap_flags().
+ * A thread that forks while another one holds a heap lock would leave the
+ * child with that lock taken forever, so the forking thread takes every
+ * lock first, in the usual order (heap locks before heaps_lock), and
+ * releases them again in both processes. Only the forking thread lives on
+ * in the child, the other threads' cached blocks are lost there.
+ */
+static void fork_lock(void) {
+	int count = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+	for(int id = 0; id < count; id++) { pthread_mutex_lock(&heaps[id].lock); }
+	pthread_mutex_lock(&heaps_lock);
+
+	// heap_create() heaps, which can't go away while heaps_lock is held
+	for(int i = 0; i < num_segments; i++) {
+		heap *h = segments[i].owner;
+		if(h != NULL && !IS_SHARED(h)) { pthread_mutex_lock(&h->lock); }
 	}
+#ifdef P3_HARDENED
+	pthread_mutex_lock(&starts_lock);
+#endif
+}
 
-	// Assign a footer to ptr
-	blockHeader* ptr_footer = (blockHeader*)((char*)ptr_header + ptr_size - 4);
-	if ((char*)ptr_footer < heap_end) {
-		ptr_footer->size_status = ptr_size;
+static void fork_unlock(void) {
+#ifdef P3_HARDENED
+	pthread_mutex_unlock(&starts_lock);
+#endif
+	for(int i = num_segments - 1; i >= 0; i--) {
+		heap *h = segments[i].owner;
+		if(h != NULL && !IS_SHARED(h)) { pthread_mutex_unlock(&h->lock); }
 	}
+	pthread_mutex_unlock(&heaps_lock);
 
-	return 0;
+	int count = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+	for(int id = count - 1; id >= 0; id--) { pthread_mutex_unlock(&heaps[id].lock); }
 }
 
-
 /*
  * Initializes the memory allocator.
  * Called ONLY once by a program.
  * Argument sizeOfRegion: the size of the heap space to be allocated.
+ * This is only the initial size, alloc() maps more memory when it runs out.
  * Returns 0 on success.
  * Returns -1 on failure.
  */                    
-int init_heap(int sizeOfRegion) {    
+int init_heap(size_t sizeOfRegion) {
+    return init_heap_flags(sizeOfRegion, 0);
+}
+
+/*
+ * Initializes the memory allocator like init_heap(), with page options
+ * for every mapping of the heap (see map_memory()):
+ * Argument flags: 0, or any of
+ *   HEAP_HUGETLB     huge pages from the hugetlb pool
+ *   HEAP_HUGETLB_1G  the same with 1 GiB pages
+ *   HEAP_HUGEPAGE    transparent huge pages
+ *   HEAP_POPULATE    fault in all pages up front, no trimming by free_block()
+ *   HEAP_DEFER_COALESCE  free small blocks into fast bins, see defer_block()
+ *   HEAP_FIRST_FIT, HEAP_NEXT_FIT, HEAP_GOOD_FIT(pct)
+ *                    placement policy instead of best fit, see fl_search
+ *   HEAP_DIRECT_MIN(shift)  map requests of 2^shift bytes and up on their
+ *                    own instead of 1 MiB ones, see direct_alloc()
+ * With huge pages the heap and every segment are rounded up to the huge
+ * page size. If no huge pages are available the heap still works, it is
+ * just backed by normal pages.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int init_heap_flags(size_t sizeOfRegion, int flags) {    
 
     static int allocated_once = 0; //prevent multiple myInit calls
 
-    int   pagesize; // page size
-    int   padsize;  // size of padding when heap size is not a multiple of page size
+    size_t pagesize; // page size
+    size_t padsize;  // size of padding when heap size is not a multiple of page size
     void* mmap_ptr; // pointer to memory mapped area
-    int   fd;
 
     blockHeader* end_mark;
 
@@ -302,13 +3727,37 @@ int init_heap(int sizeOfRegion) {
         return -1;
     }
 
-    if (sizeOfRegion <= 0) {
+    if (sizeOfRegion == 0) {
         fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
         return -1;
     }
 
-    // Get the pagesize from O.S. 
+    // Get the pagesize from O.S., huge pages are mapped in their own size
     pagesize = getpagesize();
+    if (flags & HEAP_HUGETLB_1G) pagesize = 1024 * 1024 * 1024;
+    else if (flags & (HEAP_HUGETLB | HEAP_HUGEPAGE)) pagesize = huge_page_size();
+    heap_flags = flags;
+    map_page = pagesize;
+
+    // Placement policy
+    if (flags & HEAP_FIRST_FIT) fl_search = fl_first;
+    else if (flags & HEAP_NEXT_FIT) fl_search = fl_next;
+    else if (flags & HEAP_GOOD_FIT(0)) {
+        fl_search = fl_good;
+        good_fit_pct = (flags >> 8) & 0xff;
+    }
+
+    // Smallest request that gets a mapping of its own
+    if (flags & HEAP_DIRECT_MIN(0x3f)) direct_min = (size_t)1 << ((flags >> 16) & 0x3f);
+
+    // Key of pending frees, see pending_set()
+    pending_make_cookie();
+
+    // The initial region is a single free block, so it has to fit in one
+    if (sizeOfRegion > BSIZE_MAX - pagesize) {
+        fprintf(stderr, "Error:mem.c: Requested block size is too large\n");
+        return -1;
+    }
 
     // Calculate padsize, as padding is required to round up sizeOfRegion 
     // to a multiple of pagesize
@@ -317,13 +3766,19 @@ int init_heap(int sizeOfRegion) {
 
     alloc_size = sizeOfRegion + padsize;
 
-    // Using mmap to allocate memory
-    fd = open("/dev/zero", O_RDWR);
-    if (-1 == fd) {
-        fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
-        return -1;
+    // Count the NUMA nodes, memory is only bound if there are several
+    char path[64];
+    for (num_nodes = 1; num_nodes < 64; num_nodes++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", num_nodes);
+        if (access(path, F_OK) != 0) break;
     }
-    mmap_ptr = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    // The first mapping is the first segment of the first heap
+    heap *h = &heaps[0];
+    h->node = current_node();
+
+    // Using mmap to allocate memory
+    mmap_ptr = map_memory(h, NULL, alloc_size);
     if (MAP_FAILED == mmap_ptr) {
         fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
         allocated_once = 0;
@@ -332,35 +3787,512 @@ int init_heap(int sizeOfRegion) {
 
     allocated_once = 1;
 
-    // for double word alignment and end mark
-    alloc_size -= 8;
+    // The table is still empty, so this is segments[0]
+    h->last_seg = seg_claim(mmap_ptr, alloc_size, h);
+
+    // for alignment padding and end mark
+    alloc_size -= ALIGNMENT;
 
     // Initially there is only one big free block in the heap.
-    // Skip first 4 bytes for double word alignment requirement.
-    heap_start = (blockHeader*) mmap_ptr + 1;
+    // Skip first SEG_PAD bytes for the alignment requirement.
+    heap_start = (blockHeader*)((char*)mmap_ptr + SEG_PAD);
 
     // Set the end mark
     end_mark = (blockHeader*)((void*)heap_start + alloc_size);
-    end_mark->size_status = 1;
+    end_mark->size_status = A_BIT;
 
     // Set size in header
     heap_start->size_status = alloc_size;
 
     // Set p-bit as allocated in header
     // Note a-bit left at 0 for free
-    heap_start->size_status += 2;
+    heap_start->size_status += P_BIT;
 
     // Set the footer
-    blockHeader *footer = (blockHeader*) ((void*)heap_start + alloc_size - 4);
+    blockHeader *footer = (blockHeader*) ((void*)heap_start + alloc_size - HDR_SIZE);
     footer->size_status = alloc_size;
 
+    // End of the first segment (its end mark)
+    heap_end = (char*)heap_start + alloc_size;
+
+    // The whole heap starts out as one free block on the free lists,
+    // its pages were never touched so they count as released
+    fl_insert(h, heap_start, alloc_size);
+    if ((flags & HEAP_POPULATE) == 0) mark_released(h, heap_start, alloc_size);
+
+    // Keep the locks consistent across fork()
+    pthread_atfork(fork_lock, fork_unlock, fork_unlock);
+
     return 0;
 } 
 
+/*
+ * Fills 'stats' with the current state of the heap (all heaps together),
+ * see heapStats.
+ * Cheap enough to call on a live heap: it copies the running counters
+ * under each heap's lock in turn, only the largest free block has to be
+ * looked up (in the tree, or on the highest non-empty list), the heap is
+ * not walked. Blocks on remote lists count as in use.
+ */
+void heap_stats(heapStats *stats) {
+	memset(stats, 0, sizeof(heapStats));
+
+	int count = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+	for(int id = 0; id < count; id++) {
+		heap *h = &heaps[id];
+		pthread_mutex_lock(&h->lock);
+
+		// Padding and end mark of every segment are not part of any block
+		int segs = __atomic_load_n(&num_segments, __ATOMIC_ACQUIRE);
+		for(int i = 0; i < segs; i++) {
+			if(segments[i].owner != h) { continue; }
+			stats->heap_size += segments[i].len;
+			stats->used_bytes += segments[i].len - SEG_PAD - HDR_SIZE;
+		}
+		pthread_mutex_lock(&heaps_lock);
+		for(size_t i = 0; direct_table != NULL && i <= direct_mask; i++) {
+			heapSegment *seg = direct_table[i];
+			if(seg == NULL || seg == DIRECT_GONE || seg->owner != h) { continue; }
+			stats->heap_size += seg->len;
+			stats->used_bytes += seg->len - SEG_PAD - HDR_SIZE;
+			stats->used_blocks++;
+		}
+		pthread_mutex_unlock(&heaps_lock);
+
+		for(int cls = 0; cls < NUM_CLASSES; cls++) {
+			stats->class_free_blocks[cls] += h->fl_count[cls];
+			stats->class_free_bytes[cls] += h->fl_bytes[cls];
+			stats->free_blocks += h->fl_count[cls];
+			stats->free_bytes += h->fl_bytes[cls];
+			stats->used_bytes -= h->fl_bytes[cls];
+		}
+		stats->used_blocks += h->used_blocks;
+		stats->released_bytes += h->released_bytes;
+
+		// The largest free block is the last one in the tree,
+		// or on the highest non-empty list
+		size_t largest = 0;
+		if(tree_max(h) != NULL) {
+			largest = NODE(tree_max(h))->size;
+		}
+		else if(h->free_map != 0) {
+			int cls = 31 - __builtin_clz(h->free_map);
+			for(blockHeader *b = h->free_lists[cls]; b != NULL; b = LINKS(b)->next) {
+				size_t size = b->size_status & ~STATUS_BITS;
+				if(size > largest) { largest = size; }
+			}
+		}
+		if(largest > stats->largest_free) { stats->largest_free = largest; }
+
+		pthread_mutex_unlock(&h->lock);
+	}
+
+	stats->failed_allocs = __atomic_load_n(&failed_allocs, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function for coalescing every block that was freed into a fast bin
+ * (heaps made with HEAP_DEFER_COALESCE), e.g. after a burst of frees.
+ * Returns the number of blocks that were coalesced.
+ */
+size_t heap_consolidate(void) {
+	size_t count = 0;
+
+	int heap_count = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+	for(int id = 0; id < heap_count; id++) {
+		heap *h = &heaps[id];
+		pthread_mutex_lock(&h->lock);
+		heap_drain(h);
+		count += fast_consolidate(h);
+		pthread_mutex_unlock(&h->lock);
+	}
+	return count;
+}
+
+/*
+ * Gives back the pages of every block in subtree 'n' of heap 'h'.
+ */
+static void trim_tree(heap *h, blockHeader *n) {
+	if(n == NULL) { return; }
+	trim_tree(h, NODE(n)->left);
+	trim_tree(h, NODE(n)->right);
+	trim_block(h, n, NODE(n)->size, NULL, NULL);
+}
+
+/*
+ * Function for giving the free memory of the heap back to the O.S., e.g.
+ * after a phase that used a lot of memory.
+ * Returns the number of bytes of free blocks that are released now
+ * (the total, not only what this call released).
+ *
+ * free_block() already trims free blocks of TRIM_THRESHOLD bytes and up,
+ * this also releases the whole pages of every smaller block in the trees,
+ * after coalescing the fast bins, and unmaps the cached direct mappings.
+ * Blocks on the free lists and in thread caches are left alone.
+ */
+size_t heap_trim(void) {
+	size_t released = 0;
+
+	pthread_mutex_lock(&heaps_lock);
+	directMap unmap[DIRECT_CACHE];
+	int cached = direct_cached;
+	for(int i = 0; i < cached; i++) { unmap[i] = direct_take(0); }
+	pthread_mutex_unlock(&heaps_lock);
+	for(int i = 0; i < cached; i++) { munmap(unmap[i].start, unmap[i].len); }
+
+	int count = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+	for(int id = 0; id < count; id++) {
+		heap *h = &heaps[id];
+		pthread_mutex_lock(&h->lock);
+		heap_drain(h);
+		fast_consolidate(h);
+		trim_tree(h, h->free_tree);
+		released += h->released_bytes;
+		pthread_mutex_unlock(&h->lock);
+	}
+	return released;
+}
+
+/*
+ * Checks the blocks of segment 'seg' in one walk, adds its free blocks to
+ * 'free_blocks' and 'free_bytes' and its fast bin blocks to 'fast'.
+ * Returns 0, or the HEAP_CHECK_* code of the first broken invariant with
+ * 'where' set to the header of the block it was found at.
+ */
+static int check_segment(heapSegment *seg, size_t *free_blocks, size_t *free_bytes, size_t *fast, void **where) {
+	char *end = (char*)SEG_END_MARK(seg);
+	blockHeader *b = (blockHeader*)(seg->start + SEG_PAD);
+	int prev_used = 1; // the first block has its p-bit set
+
+	while((char*)b < end) {
+		*where = b;
+		bsize_t status = b->size_status;
+		bsize_t size = status & ~(bsize_t)(ALIGNMENT - 1);
+
+		// Flag bits only, a size that stays inside the segment
+		if((status & (ALIGNMENT - 1) & ~(STATUS_BITS | FAST_BIT)) != 0 || size == 0 ||
+				(size_t)size > (size_t)(end - (char*)b)) { return HEAP_CHECK_SIZE; }
+		if(((status & P_BIT) != 0) != prev_used) { return HEAP_CHECK_PBIT; }
+
+		if(status & FAST_BIT) {
+			// Fast bin blocks stay marked in use
+			if((status & A_BIT) == 0) { return HEAP_CHECK_SIZE; }
+			(*fast)++;
+		}
+		else if((status & A_BIT) == 0) {
+			if(!prev_used) { return HEAP_CHECK_ADJACENT; }
+			if(((blockHeader*)((char*)b + size - HDR_SIZE))->size_status != size) { return HEAP_CHECK_FOOTER; }
+			(*free_blocks)++;
+			*free_bytes += size;
+		}
+
+		prev_used = status & A_BIT;
+		b = (blockHeader*)((char*)b + size);
+	}
+
+	// The last block has to end right at the end mark
+	*where = b;
+	if((char*)b != end || (b->size_status & ~STATUS_BITS) != 0 || (b->size_status & A_BIT) == 0) { return HEAP_CHECK_END; }
+	if(((b->size_status & P_BIT) != 0) != prev_used) { return HEAP_CHECK_PBIT; }
+	return 0;
+}
+
+/*
+ * Checks that every block in subtree 'n' is free and as large as the
+ * tree says, and counts them in 'count'.
+ * Returns 0, or HEAP_CHECK_LISTS with 'where' set to the first bad block.
+ */
+static int check_tree(blockHeader *n, size_t *count, void **where) {
+	if(n == NULL) { return 0; }
+
+	if((n->size_status & A_BIT) != 0 || (n->size_status & ~STATUS_BITS) != NODE(n)->size) {
+		*where = n;
+		return HEAP_CHECK_LISTS;
+	}
+	(*count)++;
+
+	int ret = check_tree(NODE(n)->left, count, where);
+	return ret != 0 ? ret : check_tree(NODE(n)->right, count, where);
+}
+
+/*
+ * Checks every segment of heap 'h', then that its free lists, tree and
+ * fast bins hold exactly the blocks the walk found.
+ * Caller must hold h->lock.
+ * Returns 0 or a HEAP_CHECK_* code, see heap_check().
+ */
+static int check_heap(heap *h, void **where) {
+	size_t free_blocks = 0, free_bytes = 0, fast = 0;
+
+	int count = __atomic_load_n(&num_segments, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < count; i++) {
+		if(segments[i].owner != h) { continue; }
+		int ret = check_segment(&segments[i], &free_blocks, &free_bytes, &fast, where);
+		if(ret != 0) { return ret; }
+	}
+
+	// Every list entry is a free block of the list's class
+	size_t listed = 0, listed_bytes = 0, tree_count = 0;
+	for(int cls = 0; cls < NUM_CLASSES; cls++) {
+		listed += h->fl_count[cls];
+		listed_bytes += h->fl_bytes[cls];
+		if(cls >= TREE_CLASS) { tree_count += h->fl_count[cls]; continue; }
+
+		size_t n = 0;
+		for(blockHeader *b = h->free_lists[cls]; b != NULL; b = LINKS(b)->next) {
+			*where = b;
+			if((b->size_status & A_BIT) != 0 || size_class(b->size_status & ~STATUS_BITS) != cls || ++n > h->fl_count[cls]) {
+				return HEAP_CHECK_LISTS;
+			}
+		}
+		if(n != h->fl_count[cls]) { return HEAP_CHECK_LISTS; }
+	}
+
+	size_t n = 0;
+	int ret = check_tree(h->free_tree, &n, where);
+	if(ret != 0) { return ret; }
+
+	*where = NULL;
+	if(n != tree_count || listed != free_blocks || listed_bytes != free_bytes || fast != h->fast_blocks) {
+		return HEAP_CHECK_LISTS;
+	}
+	return 0;
+}
+
+/*
+ * Function for checking the heap for corruption, e.g. in debug builds
+ * after every so many operations. Prints nothing.
+ * Argument where: if not NULL, set to the header of the block where the
+ *   corruption was found (NULL for a count that doesn't add up).
+ * Returns 0 if the heap is consistent, otherwise the HEAP_CHECK_* code of
+ * the first problem found, see p3Heap.h.
+ *
+ * Checks every heap, heap_create() ones included (but not direct
+ * mappings), one at a time under its lock, in a single walk over its
+ * blocks plus one over its free lists:
+ * - every size is a multiple of ALIGNMENT inside its segment
+ * - every p-bit matches the a-bit of the block before it
+ * - every free block has a footer equal to its size
+ * - no two free blocks are next to each other
+ * - each segment's last block ends exactly at its end mark
+ * - the free lists, tree and fast bins hold exactly the free (and fast
+ *   bin) blocks of the heap, each in its right class
+ * Headers can't be scanned in parallel, where the next one is depends on
+ * the size in the current one.
+ */
+int heap_check(void **where) {
+	void *at = NULL;
+	int ret = 0;
+
+	int count = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+	for(int id = 0; id < count && ret == 0; id++) {
+		pthread_mutex_lock(&heaps[id].lock);
+		ret = check_heap(&heaps[id], &at);
+		pthread_mutex_unlock(&heaps[id].lock);
+	}
+
+	int segs = __atomic_load_n(&num_segments, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < segs && ret == 0; i++) {
+		heap *h = segments[i].owner;
+		if(h == NULL || IS_SHARED(h)) { continue; }
+		pthread_mutex_lock(&h->lock);
+		ret = check_heap(h, &at);
+		pthread_mutex_unlock(&h->lock);
+	}
+
+	if(where != NULL) { *where = ret != 0 ? at : NULL; }
+	return ret;
+}
+
+/*
+ * Compaction.
+ *
+ * Blocks that outlive their neighbours end up as islands between free
+ * blocks, and each one keeps the free space around it from coalescing
+ * into a block a large request would fit in. The heap can't move a block
+ * on its own, the caller holds its address. But a caller whose objects
+ * are movable (e.g. pooled buffers it only reaches through its own table)
+ * can: heap_compact_hints() lists the islands, heap_relocate() moves one
+ * into a free block further down, and its old place coalesces with the free
+ * blocks on both sides. Both only ever hold one heap's lock, so the rest
+ * of the program keeps running while the caller works through the list.
+ */
+
+/*
+ * Adds the islands of segment 'seg' to 'hints', which holds 'count' of
+ * them so far, up to 'max'.
+ * Caller must hold the lock of the segment's heap.
+ * Returns the new count.
+ */
+static size_t compact_segment(heapSegment *seg, heapCompactHint *hints, size_t count, size_t max) {
+	char *end = (char*)SEG_END_MARK(seg);
+	bsize_t prev_free = 0; // free block in front of b, 0 if there is none
+
+	for(blockHeader *b = (blockHeader*)(seg->start + SEG_PAD); (char*)b < end && count < max; ) {
+		bsize_t size = b->size_status & ~(bsize_t)(ALIGNMENT - 1);
+		blockHeader *next = (blockHeader*)((char*)b + size);
+
+		if((b->size_status & A_BIT) == 0) {
+			prev_free = size;
+			b = next;
+			continue;
+		}
+
+		// Fast bin blocks are free already, the end mark is never free
+		if(prev_free > 0 && (b->size_status & FAST_BIT) == 0 && (next->size_status & A_BIT) == 0) {
+			bsize_t next_free = next->size_status & ~STATUS_BITS;
+			if(size <= prev_free + next_free) {
+				hints[count].ptr = (char*)b + HDR_SIZE;
+				hints[count].size = size;
+				hints[count].gap = (size_t)prev_free + size + next_free;
+				count++;
+			}
+		}
+		prev_free = 0;
+		b = next;
+	}
+	return count;
+}
+
+/*
+ * Function for finding blocks worth moving with heap_relocate(): used
+ * blocks with a free block on both sides, which together are at least as
+ * large as the block.
+ * Argument hints: filled with up to 'max' of them, see heapCompactHint,
+ *   in address order within each heap.
+ * Returns the number of hints stored.
+ *
+ * Walks one heap at a time under its lock and stops at 'max', so a caller
+ * that moves what it got and asks again works through the heap a few
+ * blocks at a time. Fast bins are coalesced first, so the islands of a
+ * HEAP_DEFER_COALESCE heap show up too. Heap blocks that hold thread
+ * caches or slab pages can show up as well, the caller only moves blocks
+ * it allocated itself.
+ */
+size_t heap_compact_hints(heapCompactHint *hints, size_t max) {
+	size_t count = 0;
+
+	int heap_count = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+	for(int id = 0; id < heap_count && count < max; id++) {
+		heap *h = &heaps[id];
+		pthread_mutex_lock(&h->lock);
+		heap_drain(h);
+		fast_consolidate(h);
+		int segs = __atomic_load_n(&num_segments, __ATOMIC_ACQUIRE);
+		for(int i = 0; i < segs && count < max; i++) {
+			if(segments[i].owner != h) { continue; }
+			count = compact_segment(&segments[i], hints, count, max);
+		}
+		pthread_mutex_unlock(&h->lock);
+	}
+
+	// heap_create() and heap_open() heaps, a single segment each
+	int segs = __atomic_load_n(&num_segments, __ATOMIC_ACQUIRE);
+	for(int i = 0; i < segs && count < max; i++) {
+		heap *h = segments[i].owner;
+		if(h == NULL || IS_SHARED(h)) { continue; }
+		pthread_mutex_lock(&h->lock);
+		heap_drain(h);
+		fast_consolidate(h);
+		count = compact_segment(&segments[i], hints, count, max);
+		pthread_mutex_unlock(&h->lock);
+	}
+	return count;
+}
+
+/*
+ * Returns the smallest block in subtree 'n' of at least 'size' bytes that
+ * lies below 'limit', or NULL if there is none.
+ */
+static blockHeader* tree_below(blockHeader *n, bsize_t size, char *limit) {
+	if(n == NULL) { return NULL; }
+
+	// n and its left subtree are all too small
+	if(NODE(n)->size < size) { return tree_below(NODE(n)->right, size, limit); }
+
+	blockHeader *found = tree_below(NODE(n)->left, size, limit);
+	if(found != NULL) { return found; }
+	if((char*)n < limit) { return n; }
+	return tree_below(NODE(n)->right, size, limit);
+}
+
+/*
+ * Returns the smallest free block of heap 'h' of at least 'size' bytes
+ * that lies below 'limit', for heap_relocate(). Returns NULL if there is none.
+ */
+static blockHeader* fit_below(heap *h, bsize_t size, char *limit) {
+	for(int cls = size_class(size); cls < TREE_CLASS; cls++) {
+		blockHeader *bestFit = NULL;
+		bsize_t bestSize = BSIZE_MAX;
+		for(blockHeader *current = h->free_lists[cls]; current != NULL; current = LINKS(current)->next) {
+			bsize_t blockSize = current->size_status & ~STATUS_BITS;
+			if(blockSize >= size && blockSize < bestSize && (char*)current < limit) {
+				bestSize = blockSize;
+				bestFit = current;
+			}
+		}
+		// Every block in a higher class is larger
+		if(bestFit != NULL) { return bestFit; }
+	}
+	return tree_below(h->free_tree, size, limit);
+}
+
+/*
+ * Function for moving allocated block 'ptr' to a better place in its
+ * heap, for a caller that can update every reference to it.
+ * Returns the block's new payload address, the payload copied there and
+ * the old block freed, or ptr itself if there is no better place.
+ * Returns NULL if ptr is not an allocated block.
+ *
+ * A block only moves if a neighbour of it is free, and only down: into
+ * the smallest free block at a lower address that fits it (never into new
+ * memory). So each pass over heap_compact_hints() packs the live blocks
+ * towards the start of the heap and the free space towards its end. Its
+ * old place is coalesced right away, even in a HEAP_DEFER_COALESCE heap.
+ * Slab slots and direct blocks stay where they are. No other thread may
+ * use the block while it is moved.
+ */
+void* heap_relocate(void *ptr) {
+	heap *h;
+	bsize_t usable = ptr_check(ptr, &h);
+	if(usable == 0) { return NULL; }
+	if(find_segment(ptr)->direct || slab_find(ptr) != NULL) { return ptr; }
+
+	blockHeader *b = (blockHeader*)((char*)ptr - HDR_SIZE);
+	void *new_ptr = ptr;
+
+	pthread_mutex_lock(&h->lock);
+	heap_drain(h);
+
+	bsize_t size = b->size_status & ~STATUS_BITS;
+	blockHeader *next = (blockHeader*)((char*)b + size);
+	int island = (b->size_status & P_BIT) == 0 || (next->size_status & A_BIT) == 0;
+
+	// The smallest block below b that fits, so repeated passes pack the
+	// heap towards its start
+	blockHeader *fit = island ? fit_below(h, size, (char*)b) : NULL;
+	if(fit != NULL) { new_ptr = place_block(h, fit, size, NULL, NULL); }
+
+	if(new_ptr != ptr) {
+		memcpy(new_ptr, ptr, usable);
+		starts_clear(ptr);
+		starts_set(new_ptr);
+		release_block(h, b);
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	if(new_ptr != ptr && IS_SHARED(h)) { trace_op(HEAP_TRACE_REALLOC, new_ptr, (uintptr_t)ptr, usable, usable); }
+	return new_ptr;
+}
+
 /*
  * Can be used for DEBUGGING to help you visualize your heap structure.
  * It traverses heap blocks and prints info about each block found.
  * 
+ * Blocks sitting in a thread cache or on a remote list show up as allocated.
+ * Segments of all heaps are listed one after the other in the order they
+ * were mapped, heap_create() heaps are not shown.
+ *
  * Prints out a list of all the blocks including this information:
  * No.      : serial number of the block 
  * Status   : free/used (allocated)
@@ -376,13 +4308,23 @@ void disp_heap() {
     char   p_status[6];
     char * t_begin = NULL;
     char * t_end   = NULL;
-    int    t_size;
+    size_t t_size;
+
+    // Every heap's lock, always taken in the same order, then heaps_lock
+    // so no direct mapping goes away meanwhile
+    int heap_count = __atomic_load_n(&num_heaps, __ATOMIC_ACQUIRE);
+    for (int id = 0; id < heap_count; id++) {
+        pthread_mutex_lock(&heaps[id].lock);
+    }
+    pthread_mutex_lock(&heaps_lock);
 
     blockHeader *current = heap_start;
+    int seg = 0;
+    size_t direct = 0;
     counter = 1;
 
-    int used_size =  0;
-    int free_size =  0;
+    size_t used_size =  0;
+    size_t free_size =  0;
     int is_used   = -1;
 
     fprintf(stdout, 
@@ -391,23 +4333,28 @@ void disp_heap() {
     fprintf(stdout, 
             "--------------------------------------------------------------------------------\n");
 
-    while (current->size_status != 1) {
+    while ((current->size_status & ~STATUS_BITS) != 0) {
         t_begin = (char*)current;
         t_size = current->size_status;
 
-        if (t_size & 1) {
+        if (t_size & FAST_BIT) {
+            // In a fast bin, still marked used
+            strcpy(status, "fast ");
+            is_used = 1;
+            t_size = t_size - FAST_BIT - A_BIT;
+        } else if (t_size & A_BIT) {
             // LSB = 1 => used block
             strcpy(status, "alloc");
             is_used = 1;
-            t_size = t_size - 1;
+            t_size = t_size - A_BIT;
         } else {
             strcpy(status, "FREE ");
             is_used = 0;
         }
 
-        if (t_size & 2) {
+        if (t_size & P_BIT) {
             strcpy(p_status, "alloc");
-            t_size = t_size - 2;
+            t_size = t_size - P_BIT;
         } else {
             strcpy(p_status, "FREE ");
         }
@@ -419,23 +4366,40 @@ void disp_heap() {
 
         t_end = t_begin + t_size - 1;
 
-        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%4i\n", counter, status, 
+        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%4zu\n", counter, status, 
                 p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
 
         current = (blockHeader*)((char*)current + t_size);
         counter = counter + 1;
+
+        // At an end mark, continue with the first block of the next segment,
+        // then with the direct ones
+        if ((current->size_status & ~STATUS_BITS) == 0) {
+            while (++seg < num_segments && !IS_SHARED(segments[seg].owner)) ;
+            if (seg < num_segments) current = (blockHeader*)(segments[seg].start + SEG_PAD);
+        }
+        if ((current->size_status & ~STATUS_BITS) == 0 && direct_table != NULL) {
+            while (direct < direct_mask + 1 && (direct_table[direct] == NULL ||
+                    direct_table[direct] == DIRECT_GONE || !IS_SHARED(direct_table[direct]->owner))) direct++;
+            if (direct < direct_mask + 1) current = (blockHeader*)(direct_table[direct++]->start + SEG_PAD);
+        }
     }
 
     fprintf(stdout, 
             "--------------------------------------------------------------------------------\n");
     fprintf(stdout, 
             "********************************************************************************\n");
-    fprintf(stdout, "Total used size = %4d\n", used_size);
-    fprintf(stdout, "Total free size = %4d\n", free_size);
-    fprintf(stdout, "Total size      = %4d\n", used_size + free_size);
+    fprintf(stdout, "Total used size = %4zu\n", used_size);
+    fprintf(stdout, "Total free size = %4zu\n", free_size);
+    fprintf(stdout, "Total size      = %4zu\n", used_size + free_size);
     fprintf(stdout, 
             "********************************************************************************\n");
     fflush(stdout);
 
+    pthread_mutex_unlock(&heaps_lock);
+    for (int id = heap_count - 1; id >= 0; id--) {
+        pthread_mutex_unlock(&heaps[id].lock);
+    }
+
     return;  
 }
\ No newline at end of file
@@ -0,0 +1,144 @@
+#ifndef __p3Heap_h
+#define __p3Heap_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Public interface of the heap allocator in p3Heap.c.
+ * init_heap() has to be called once before any other function.
+ * Every function is safe to call from multiple threads.
+ */
+
+// Separate heap made by heap_create()
+typedef struct heap heap_t;
+
+// Bump allocator on top of the heap, made by arena_create()
+typedef struct arena arena_t;
+
+/*
+ * Heap statistics returned by heap_stats(). Sizes are in bytes and count
+ * whole blocks, headers included. Blocks held in a thread cache or a fast
+ * bin, or used for slab pages, count as in use.
+ */
+#define HEAP_STATS_CLASSES 32
+
+typedef struct heapStats {
+    size_t heap_size;       // memory mapped for the heap
+    size_t used_bytes;      // in allocated blocks
+    size_t free_bytes;      // in free blocks
+    size_t used_blocks;     // number of allocated blocks
+    size_t free_blocks;     // number of free blocks
+    size_t largest_free;    // size of the largest free block
+    size_t released_bytes;  // part of free_bytes whose pages were given back to the O.S.
+    size_t failed_allocs;   // allocation calls that ran out of memory
+    // Free blocks per size class, class i holds sizes in [2^(i+4), 2^(i+5))
+    // (the first class also holds anything smaller, the last anything bigger)
+    size_t class_free_blocks[HEAP_STATS_CLASSES];
+    size_t class_free_bytes[HEAP_STATS_CLASSES];
+} heapStats;
+
+/*
+ * Block worth moving, reported by heap_compact_hints(): a used block
+ * between two free blocks, which heap_relocate() can move elsewhere.
+ */
+typedef struct heapCompactHint {
+    void *ptr;              // payload address of the block
+    size_t size;            // size of the block
+    size_t gap;             // size of the free block moving it would leave behind
+} heapCompactHint;
+
+/*
+ * Options for init_heap_flags(), or'ed together.
+ */
+#define HEAP_HUGETLB        0x01    // huge pages from the hugetlb pool (MAP_HUGETLB)
+#define HEAP_HUGETLB_1G     0x02    // the same with 1 GiB pages
+#define HEAP_HUGEPAGE       0x04    // transparent huge pages (MADV_HUGEPAGE)
+#define HEAP_POPULATE       0x08    // fault in every page when it is mapped
+#define HEAP_DEFER_COALESCE 0x10    // free small blocks into fast bins, coalesce them later
+// Placement policy, best fit if none is given
+#define HEAP_FIRST_FIT      0x20    // first block that fits
+#define HEAP_NEXT_FIT       0x40    // first fit, from where the last search stopped
+#define HEAP_GOOD_FIT(pct)  (0x80 | ((pct) & 0xff) << 8)   // best fit, but any block at most pct% larger will do
+// Requests of 2^shift bytes and up get a mapping of their own (1 MiB if not given, 63 for never)
+#define HEAP_DIRECT_MIN(shift) (((shift) & 0x3f) << 16)
+
+/*
+ * Problems heap_check() reports.
+ */
+#define HEAP_CHECK_SIZE     1   // size not aligned, zero or past the end of its segment
+#define HEAP_CHECK_PBIT     2   // p-bit doesn't match the previous block
+#define HEAP_CHECK_FOOTER   3   // free block whose footer isn't its size
+#define HEAP_CHECK_ADJACENT 4   // two free blocks next to each other
+#define HEAP_CHECK_END      5   // blocks don't end at the segment's end mark
+#define HEAP_CHECK_LISTS    6   // free lists, tree or fast bins don't match the blocks
+
+/*
+ * Allocation traces, written by builds with -DP3_TRACE and replayed by
+ * p3Replay. A trace file is a heapTraceHeader followed by records, in
+ * chunks of one thread each (every chunk is in time order, the chunks of
+ * different threads are not).
+ */
+#define HEAP_TRACE_MAGIC   0x52543350    // "P3TR"
+#define HEAP_TRACE_VERSION 2
+
+#define HEAP_TRACE_ALLOC   1    // alloc() and alloc_batch()
+#define HEAP_TRACE_ALIGNED 2    // alloc_aligned(), arg is the alignment
+#define HEAP_TRACE_REALLOC 3    // realloc_block(), arg is the old address
+#define HEAP_TRACE_FREE    4    // free_block(), free_block_sized() and free_batch()
+
+typedef struct heapTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;   // sizeof(heapTraceRecord)
+    uint32_t unused;
+} heapTraceHeader;
+
+typedef struct heapTraceRecord {
+    uint64_t time;          // ns since the first record of the process
+    uint64_t addr;          // payload address, 0 for a failed allocation
+    uint64_t arg;           // see the ops above, 0 otherwise
+    uint64_t size;          // requested size, 0 for a free
+    uint64_t block;         // usable size of the block after rounding
+    uint16_t thread;        // thread number, in order of their first record
+    uint8_t  op;            // HEAP_TRACE_*
+    uint8_t  unused[5];
+} heapTraceRecord;
+
+int    init_heap(size_t sizeOfRegion);
+int    init_heap_flags(size_t sizeOfRegion, int flags);
+void   disp_heap();
+void   heap_stats(heapStats *stats);
+size_t heap_trim(void);
+size_t heap_consolidate(void);
+int    heap_check(void **where);
+size_t heap_compact_hints(heapCompactHint *hints, size_t max);
+void*  heap_relocate(void *ptr);
+void   heap_trace_flush(void);
+
+void*  alloc(size_t size);
+void*  alloc_zeroed(size_t size);
+void*  alloc_aligned(size_t size, size_t alignment);
+size_t alloc_batch(size_t size, size_t n, void **out);
+void*  realloc_block(void *ptr, size_t size);
+
+int    free_block(void *ptr);
+int    free_batch(void **ptrs, size_t n);
+int    free_block_sized(void *ptr, size_t size);
+
+size_t block_usable_size(void *ptr);
+
+heap_t* heap_create(size_t size);
+void*   heap_alloc(heap_t *h, size_t size);
+int     heap_free(heap_t *h, void *ptr);
+void    heap_destroy(heap_t *h);
+heap_t* heap_open(const char *path, size_t size);
+void*   heap_root(heap_t *h);
+int     heap_set_root(heap_t *h, void *ptr);
+
+arena_t* arena_create(size_t size);
+void*    arena_alloc(arena_t *a, size_t size);
+void     arena_reset(arena_t *a);
+void     arena_destroy(arena_t *a);
+
+#endif // __p3Heap_h
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "p3Heap.h"
+
+/*
+ * malloc() interposition shim, built into libp3malloc.so together with
+ * p3Heap.c. Preloading it runs any program on p3Heap:
+ *
+ *   LD_PRELOAD=./libp3malloc.so program
+ *
+ * It exports the standard allocation functions and maps them to the heap
+ * API. The heap is initialized at the first call, with init_heap_flags()
+ * and these environment variables:
+ *   P3_HEAP_SIZE    size of the first heap segment, 64 MiB if not set
+ *   P3_HEAP_FLAGS   init_heap_flags() options as a number (e.g. 0x14)
+ * fork() is safe, p3Heap.c registers fork handlers for its locks.
+ *
+ * Everything else in the library is hidden, so the program's own symbols
+ * never clash with p3Heap's.
+ */
+#define EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_HEAP_SIZE (64 * 1024 * 1024)
+
+/*
+ * Boot memory.
+ * init_heap_flags() itself may call malloc() (through stdio or
+ * pthread_atfork()). Those calls are served from a static buffer that is
+ * never reused, every allocation in it keeps its size in front of it.
+ */
+#define BOOT_SIZE (64 * 1024)
+#define BOOT_ALIGN 16
+
+static char boot_heap[BOOT_SIZE] __attribute__((aligned(BOOT_ALIGN)));
+static size_t boot_used = 0;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int ready = 0;                   // heap is initialized, atomic
+static __thread int initializing = 0;   // this thread is initializing it
+
+static int is_boot(void *ptr) {
+	return (char*)ptr >= boot_heap && (char*)ptr < boot_heap + BOOT_SIZE;
+}
+
+/*
+ * Allocates 'size' bytes of boot memory aligned to BOOT_ALIGN, or NULL if
+ * the buffer is full.
+ */
+static void* boot_alloc(size_t size) {
+	if(size > BOOT_SIZE) { return NULL; }
+
+	size_t need = (BOOT_ALIGN + size + BOOT_ALIGN - 1) & ~(size_t)(BOOT_ALIGN - 1);
+	size_t start = __atomic_fetch_add(&boot_used, need, __ATOMIC_RELAXED);
+	if(start + need > BOOT_SIZE) { return NULL; }
+
+	char *ptr = boot_heap + start + BOOT_ALIGN;
+	((size_t*)ptr)[-1] = size;
+	return ptr;
+}
+
+static void heap_init(void) {
+	initializing = 1;
+
+	size_t size = DEFAULT_HEAP_SIZE;
+	int flags = 0;
+	const char *env = getenv("P3_HEAP_SIZE");
+	if(env != NULL && strtoull(env, NULL, 0) > 0) { size = strtoull(env, NULL, 0); }
+	env = getenv("P3_HEAP_FLAGS");
+	if(env != NULL) { flags = strtol(env, NULL, 0); }
+
+	if(init_heap_flags(size, flags) != 0) {
+		static const char msg[] = "p3malloc: init_heap failed\n";
+		write(2, msg, sizeof(msg) - 1);
+		abort();
+	}
+
+	initializing = 0;
+	__atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Makes sure the heap is initialized.
+ * Returns 1 if the heap can be used, 0 while this thread is still
+ * initializing it (boot memory has to be used then).
+ */
+static inline int heap_ready(void) {
+	if(__builtin_expect(__atomic_load_n(&ready, __ATOMIC_ACQUIRE), 1)) { return 1; }
+	if(initializing) { return 0; }
+
+	pthread_once(&init_once, heap_init);
+	return 1;
+}
+
+EXPORT void* malloc(size_t size) {
+	if(!heap_ready()) { return boot_alloc(size); }
+
+	// malloc(0) has to return a pointer that free() accepts
+	void *ptr = alloc(size > 0 ? size : 1);
+	if(ptr == NULL) { errno = ENOMEM; }
+	return ptr;
+}
+
+EXPORT void free(void *ptr) {
+	if(ptr == NULL || is_boot(ptr)) { return; }
+	free_block(ptr);
+}
+
+EXPORT void* calloc(size_t n, size_t size) {
+	if(size != 0 && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Boot memory is never reused, so it is still zero
+	if(!heap_ready()) { return boot_alloc(n * size); }
+
+	void *ptr = alloc_zeroed(n * size > 0 ? n * size : 1);
+	if(ptr == NULL) { errno = ENOMEM; }
+	return ptr;
+}
+
+EXPORT void* realloc(void *ptr, size_t size) {
+	if(ptr == NULL) { return malloc(size); }
+	if(size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	if(is_boot(ptr)) {
+		void *new_ptr = malloc(size);
+		size_t old = ((size_t*)ptr)[-1];
+		if(new_ptr != NULL) { memcpy(new_ptr, ptr, old < size ? old : size); }
+		return new_ptr;
+	}
+
+	void *new_ptr = realloc_block(ptr, size);
+	if(new_ptr == NULL) { errno = ENOMEM; }
+	return new_ptr;
+}
+
+/*
+ * Allocates 'size' bytes aligned to 'alignment', a power of 2, for the
+ * aligned allocation functions below.
+ */
+static void* aligned(size_t alignment, size_t size) {
+	if(!heap_ready()) { return alignment <= BOOT_ALIGN ? boot_alloc(size) : NULL; }
+
+	void *ptr = alloc_aligned(size > 0 ? size : 1, alignment);
+	if(ptr == NULL) { errno = ENOMEM; }
+	return ptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+	if(alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) { return EINVAL; }
+
+	int saved = errno;
+	void *ptr = aligned(alignment, size);
+	errno = saved;
+	if(ptr == NULL) { return ENOMEM; }
+
+	*memptr = ptr;
+	return 0;
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+	if(alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return aligned(alignment, size);
+}
+
+EXPORT void* memalign(size_t alignment, size_t size) {
+	return aligned_alloc(alignment, size);
+}
+
+EXPORT void* valloc(size_t size) {
+	return aligned(getpagesize(), size);
+}
+
+EXPORT void* pvalloc(size_t size) {
+	size_t pagesize = getpagesize();
+	if(size > SIZE_MAX - pagesize) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return aligned(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+	if(ptr == NULL) { return 0; }
+	if(is_boot(ptr)) { return ((size_t*)ptr)[-1]; }
+	return block_usable_size(ptr);
+}
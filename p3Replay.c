@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "p3Heap.h"
+
+/*
+ * Replays an allocation trace against p3Heap.
+ *
+ * The trace is one a program wrote with a -DP3_TRACE build of p3Heap (see
+ * heapTraceRecord in p3Heap.h). Its records are sorted by time and replayed
+ * in that order from a single thread, every traced address stands for the
+ * block the replay got in its place. So the same workload can be run again
+ * with other heap options and the results compared. It reports:
+ *   - ops/s      operations per second
+ *   - peak live  most bytes requested and not yet freed at one time
+ *   - heap       memory mapped for the heap at the end
+ *   - largest    largest free block at the end
+ *   - failed     allocations that failed in the replay
+ *   - frag       1 - peak live / heap
+ *
+ * Usage: p3Replay [-H heap size] [-o options] [-b] trace
+ *
+ * -o takes a comma separated list of init_heap_flags() options: hugetlb,
+ * hugetlb1g, hugepage, populate, defer, the placement policies firstfit,
+ * nextfit, goodfit=pct (goodfit alone is 10%), and direct=shift for the
+ * smallest request that is mapped on its own (2^shift bytes). -b writes
+ * the trace in the text format of p3Bench -t to stdout instead of
+ * replaying it, so the workload can be benchmarked against glibc as well.
+ */
+
+typedef struct liveEntry {
+    uint64_t addr;          // traced address
+    void *ptr;              // block of the replay in its place
+    size_t size;            // requested size
+    uint32_t slot;          // slot for -b
+    int used;               // 0 empty, 1 live, -1 deleted
+} liveEntry;
+
+// Live traced addresses, open addressing with linear probing
+static liveEntry *live = NULL;
+static size_t live_mask = 0;
+
+static size_t live_hash(uint64_t addr) {
+	return (size_t)((addr >> 3) * 0x9e3779b97f4a7c15ull >> 16) & live_mask;
+}
+
+/*
+ * Returns the live entry of traced address 'addr', or NULL.
+ */
+static liveEntry* live_find(uint64_t addr) {
+	for(size_t i = live_hash(addr); live[i].used != 0; i = (i + 1) & live_mask) {
+		if(live[i].used == 1 && live[i].addr == addr) { return &live[i]; }
+	}
+	return NULL;
+}
+
+/*
+ * Returns a new live entry for traced address 'addr'.
+ * The table has room for every record, so there always is one.
+ */
+static liveEntry* live_insert(uint64_t addr) {
+	size_t i = live_hash(addr);
+	while(live[i].used == 1) { i = (i + 1) & live_mask; }
+
+	live[i].used = 1;
+	live[i].addr = addr;
+	return &live[i];
+}
+
+/*
+ * Orders pointers to records by time, records of the same time keep
+ * their order in the file.
+ */
+static int cmp_record(const void *a, const void *b) {
+	const heapTraceRecord *x = *(heapTraceRecord* const*)a;
+	const heapTraceRecord *y = *(heapTraceRecord* const*)b;
+	if(x->time != y->time) { return x->time < y->time ? -1 : 1; }
+	return (x > y) - (x < y);
+}
+
+/*
+ * Reads trace file 'path', sorted by time.
+ * Sets 'n' to the number of records.
+ */
+static heapTraceRecord* read_records(const char *path, size_t *n) {
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) { perror(path); exit(1); }
+
+	heapTraceHeader header;
+	if(fread(&header, sizeof(header), 1, f) != 1 || header.magic != HEAP_TRACE_MAGIC ||
+			header.version != HEAP_TRACE_VERSION || header.record_size != sizeof(heapTraceRecord)) {
+		fprintf(stderr, "%s: not a p3Heap trace\n", path);
+		exit(1);
+	}
+
+	size_t cap = 1024, count = 0;
+	heapTraceRecord *records = malloc(cap * sizeof(heapTraceRecord));
+	while(records != NULL && fread(&records[count], sizeof(heapTraceRecord), 1, f) == 1) {
+		if(++count == cap) {
+			cap *= 2;
+			records = realloc(records, cap * sizeof(heapTraceRecord));
+		}
+	}
+	if(records == NULL) { perror("malloc"); exit(1); }
+	fclose(f);
+
+	// Chunks of different threads overlap in time
+	heapTraceRecord **order = malloc((count + 1) * sizeof(heapTraceRecord*));
+	heapTraceRecord *sorted = malloc((count + 1) * sizeof(heapTraceRecord));
+	if(order == NULL || sorted == NULL) { perror("malloc"); exit(1); }
+
+	for(size_t i = 0; i < count; i++) { order[i] = &records[i]; }
+	qsort(order, count, sizeof(heapTraceRecord*), cmp_record);
+	for(size_t i = 0; i < count; i++) { sorted[i] = *order[i]; }
+
+	free(order);
+	free(records);
+
+	*n = count;
+	return sorted;
+}
+
+/*
+ * Writes 'n' records as a p3Bench trace, live blocks are numbered with
+ * the lowest free slot.
+ */
+static void write_bench_trace(heapTraceRecord *records, size_t n) {
+	uint32_t *free_slots = malloc((n + 1) * sizeof(uint32_t));
+	if(free_slots == NULL) { perror("malloc"); exit(1); }
+	size_t num_free = 0;
+	uint32_t next_slot = 0;
+
+	for(size_t i = 0; i < n; i++) {
+		heapTraceRecord *r = &records[i];
+
+		// A realloc is a free and an alloc, unless it failed
+		if(r->op == HEAP_TRACE_FREE || (r->op == HEAP_TRACE_REALLOC && r->addr != 0)) {
+			liveEntry *e = live_find(r->op == HEAP_TRACE_FREE ? r->addr : r->arg);
+			if(e != NULL) {
+				printf("f %u\n", e->slot);
+				free_slots[num_free++] = e->slot;
+				e->used = -1;
+			}
+		}
+
+		if(r->op != HEAP_TRACE_FREE && r->addr != 0) {
+			liveEntry *e = live_insert(r->addr);
+			e->slot = num_free > 0 ? free_slots[--num_free] : next_slot++;
+			printf("a %u %lu\n", e->slot, (unsigned long)r->size);
+		}
+	}
+	free(free_slots);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Replays 'n' records, prints the results.
+ * Operations on addresses the replay doesn't know (freed twice, or
+ * allocations that failed here but not in the trace) are skipped.
+ */
+static void replay(heapTraceRecord *records, size_t n) {
+	size_t live_bytes = 0, peak_live = 0, failed = 0, skipped = 0;
+
+	uint64_t start = now_ns();
+	for(size_t i = 0; i < n; i++) {
+		heapTraceRecord *r = &records[i];
+		liveEntry *e;
+
+		switch(r->op) {
+			case HEAP_TRACE_ALLOC:
+			case HEAP_TRACE_ALIGNED:
+				if(r->addr == 0) { continue; }
+
+				e = live_insert(r->addr);
+				e->ptr = r->op == HEAP_TRACE_ALLOC ? alloc(r->size) : alloc_aligned(r->size, r->arg);
+				e->size = r->size;
+				if(e->ptr == NULL) {
+					failed++;
+					e->used = -1;
+					continue;
+				}
+				live_bytes += r->size;
+				break;
+
+			case HEAP_TRACE_REALLOC:
+				if(r->addr == 0) { continue; }
+
+				e = live_find(r->arg);
+				if(e == NULL) { skipped++; continue; }
+
+				void *ptr = realloc_block(e->ptr, r->size);
+				if(ptr == NULL) { failed++; continue; }
+
+				live_bytes -= e->size;
+				e->used = -1;
+				e = live_insert(r->addr);
+				e->ptr = ptr;
+				e->size = r->size;
+				live_bytes += r->size;
+				break;
+
+			case HEAP_TRACE_FREE:
+				e = live_find(r->addr);
+				if(e == NULL) { skipped++; continue; }
+
+				free_block(e->ptr);
+				live_bytes -= e->size;
+				e->used = -1;
+				break;
+
+			default:
+				skipped++;
+				continue;
+		}
+		if(live_bytes > peak_live) { peak_live = live_bytes; }
+	}
+	double seconds = (now_ns() - start) / 1e9;
+
+	heapStats stats;
+	heap_stats(&stats);
+	double frag = stats.heap_size > 0 ? 1.0 - (double)peak_live / stats.heap_size : 0;
+
+	printf("%-10s %12s %12s %12s %12s %8s %6s\n", "ops", "ops/s", "peak live", "heap", "largest", "failed", "frag");
+	printf("%-10zu %12.0f %12zu %12zu %12zu %8zu %5.1f%%\n", n, seconds > 0 ? n / seconds : 0,
+			peak_live, stats.heap_size, stats.largest_free, failed, frag * 100);
+	if(skipped > 0) { printf("%zu records skipped\n", skipped); }
+}
+
+/*
+ * Parses the comma separated options of -o into init_heap_flags() flags.
+ */
+static int parse_flags(char *list) {
+	struct { const char *name; int flag; } names[] = {
+		{ "hugetlb",   HEAP_HUGETLB },
+		{ "hugetlb1g", HEAP_HUGETLB_1G },
+		{ "hugepage",  HEAP_HUGEPAGE },
+		{ "populate",  HEAP_POPULATE },
+		{ "defer",     HEAP_DEFER_COALESCE },
+		{ "firstfit",  HEAP_FIRST_FIT },
+		{ "nextfit",   HEAP_NEXT_FIT },
+		{ "goodfit",   HEAP_GOOD_FIT(10) },
+	};
+
+	int flags = 0;
+	for(char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		if(strncmp(name, "goodfit=", 8) == 0) {
+			flags |= HEAP_GOOD_FIT(atoi(name + 8));
+			continue;
+		}
+		if(strncmp(name, "direct=", 7) == 0) {
+			flags |= HEAP_DIRECT_MIN(atoi(name + 7));
+			continue;
+		}
+
+		size_t i;
+		for(i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+			if(strcmp(name, names[i].name) == 0) { break; }
+		}
+		if(i == sizeof(names) / sizeof(names[0])) { return -1; }
+		flags |= names[i].flag;
+	}
+	return flags;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-H heap size] [-o hugetlb,hugetlb1g,hugepage,populate,defer,firstfit,nextfit,goodfit=pct,direct=shift] [-b] trace\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	size_t heap_size = 1024 * 1024;
+	int flags = 0;
+	int bench_trace = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "H:o:b")) != -1) {
+		switch(opt) {
+			case 'H': heap_size = strtoul(optarg, NULL, 10); break;
+			case 'o': flags = parse_flags(optarg); break;
+			case 'b': bench_trace = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1 || heap_size == 0 || flags < 0) { usage(argv[0]); }
+
+	size_t n;
+	heapTraceRecord *records = read_records(argv[optind], &n);
+
+	// At most one live entry per record, at least half the table stays empty
+	size_t cap = 16;
+	while(cap < 2 * n) { cap *= 2; }
+	live = calloc(cap, sizeof(liveEntry));
+	if(live == NULL) { perror("malloc"); exit(1); }
+	live_mask = cap - 1;
+
+	if(bench_trace) {
+		write_bench_trace(records, n);
+	}
+	else {
+		if(init_heap_flags(heap_size, flags) != 0) {
+			fprintf(stderr, "init_heap failed\n");
+			exit(1);
+		}
+		replay(records, n);
+	}
+
+	free(records);
+	free(live);
+	return 0;
+}